@@ -0,0 +1,265 @@
+#include "block_stats.h"
+#include "cpu_dispatch.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
+
+// blocks block_sums() adds up per pass
+#define SUMS_CHUNK 64
+
+// column totals first, one image row at a time: that loop runs along the
+// row, so it vectorizes at whatever width the tier has; each block then
+// adds up its BLOCK_SIZE columns
+CPU_KERNEL_BODY void block_sums_body(const uint8_t *src, int stride, int count,
+                                     uint32_t *sum_out, uint32_t *sq_out) {
+    uint16_t col_sum[SUMS_CHUNK * BLOCK_SIZE];
+    uint32_t col_sq[SUMS_CHUNK * BLOCK_SIZE];
+
+    while (count > 0) {
+        int n = count < SUMS_CHUNK ? count : SUMS_CHUNK;
+        int cols = n * BLOCK_SIZE;
+
+        memset(col_sum, 0, sizeof(col_sum));
+        memset(col_sq, 0, sizeof(col_sq));
+        for (int by = 0; by < BLOCK_SIZE; by++) {
+            const uint8_t *row = src + (size_t)by * stride;
+            for (int x = 0; x < cols; x++) {
+                uint16_t v = row[x];
+                col_sum[x] = (uint16_t)(col_sum[x] + v);
+                col_sq[x] += (uint32_t)(v * v);
+            }
+        }
+
+        for (int b = 0; b < n; b++) {
+            uint16_t sum = 0;
+            uint32_t sq = 0;
+            for (int bx = 0; bx < BLOCK_SIZE; bx++) {
+                sum = (uint16_t)(sum + col_sum[b * BLOCK_SIZE + bx]);
+                sq += col_sq[b * BLOCK_SIZE + bx];
+            }
+            sum_out[b] = sum;
+            sq_out[b] = sq;
+        }
+
+        src += cols;
+        sum_out += n;
+        sq_out += n;
+        count -= n;
+    }
+}
+
+static void block_sums_portable(const uint8_t *src, int stride, int count,
+                                uint32_t *sum_out, uint32_t *sq_out) {
+    block_sums_body(src, stride, count, sum_out, sq_out);
+}
+
+#ifdef CPU_DISPATCH_X86
+CPU_TARGET_AVX2
+static void block_sums_avx2(const uint8_t *src, int stride, int count,
+                            uint32_t *sum_out, uint32_t *sq_out) {
+    block_sums_body(src, stride, count, sum_out, sq_out);
+}
+
+CPU_TARGET_AVX512
+static void block_sums_avx512(const uint8_t *src, int stride, int count,
+                              uint32_t *sum_out, uint32_t *sq_out) {
+    block_sums_body(src, stride, count, sum_out, sq_out);
+}
+#endif
+
+void block_sums(const uint8_t *src, int stride, int count,
+                uint32_t *sum_out, uint32_t *sq_out) {
+    switch (cpu_tier()) {
+#ifdef CPU_DISPATCH_X86
+    case CPU_TIER_AVX512: block_sums_avx512(src, stride, count, sum_out, sq_out); return;
+    case CPU_TIER_AVX2: block_sums_avx2(src, stride, count, sum_out, sq_out); return;
+#endif
+    default: block_sums_portable(src, stride, count, sum_out, sq_out); return;
+    }
+}
+
+float calculate_small_median(float *arr, int size) {
+    for (int i = 0; i < size - 1; i++) {
+        for (int j = 0; j < size - i - 1; j++) {
+            if (arr[j] > arr[j + 1]) {
+                float temp = arr[j];
+                arr[j] = arr[j + 1];
+                arr[j + 1] = temp;
+            }
+        }
+    }
+    return arr[size / 2];
+}
+
+#if (BLOCK_AREA & (BLOCK_AREA - 1)) == 0 && BLOCK_AREA <= 256
+
+// batcher odd-even merge sort has (n/4) log n (log n - 1) + n - 1 comparators
+#define NETWORK_MAX_PAIRS 3840
+
+// comparator list of the selection network: the sorting network with every
+// comparator that cannot influence output BLOCK_AREA / 2 removed
+static uint8_t network[NETWORK_MAX_PAIRS][2];
+static int network_pairs = 0;
+static pthread_once_t network_once = PTHREAD_ONCE_INIT;
+
+static void build_network(void) {
+    static uint8_t full[NETWORK_MAX_PAIRS][2];
+    int n = BLOCK_AREA;
+    int pairs = 0;
+
+    // iterative batcher odd-even merge sort
+    for (int p = 1; p < n; p <<= 1) {
+        for (int k = p; k >= 1; k >>= 1) {
+            for (int j = k % p; j + k < n; j += 2 * k) {
+                for (int i = 0; i < k && i + j + k < n; i++) {
+                    if ((i + j) / (2 * p) == (i + j + k) / (2 * p)) {
+                        full[pairs][0] = (uint8_t)(i + j);
+                        full[pairs][1] = (uint8_t)(i + j + k);
+                        pairs++;
+                    }
+                }
+            }
+        }
+    }
+
+    // walk backwards from the median output and keep only what feeds it
+    static bool keep[NETWORK_MAX_PAIRS];
+    bool needed[BLOCK_AREA] = {false};
+    needed[n / 2] = true;
+    for (int c = pairs - 1; c >= 0; c--) {
+        keep[c] = needed[full[c][0]] || needed[full[c][1]];
+        if (keep[c]) {
+            needed[full[c][0]] = true;
+            needed[full[c][1]] = true;
+        }
+    }
+
+    int kept = 0;
+    for (int c = 0; c < pairs; c++) {
+        if (keep[c]) {
+            network[kept][0] = full[c][0];
+            network[kept][1] = full[c][1];
+            kept++;
+        }
+    }
+    network_pairs = kept;
+}
+
+// one comparator over a vector of lanes: a = min, b = max
+static inline void compare_16(uint8_t *a, uint8_t *b) {
+#if defined(__SSE2__)
+    __m128i va = _mm_load_si128((const __m128i *)a);
+    __m128i vb = _mm_load_si128((const __m128i *)b);
+    _mm_store_si128((__m128i *)a, _mm_min_epu8(va, vb));
+    _mm_store_si128((__m128i *)b, _mm_max_epu8(va, vb));
+#else
+    for (int l = 0; l < 16; l++) {
+        uint8_t lo = a[l] < b[l] ? a[l] : b[l];
+        uint8_t hi = a[l] < b[l] ? b[l] : a[l];
+        a[l] = lo;
+        b[l] = hi;
+    }
+#endif
+}
+
+#ifdef CPU_DISPATCH_X86
+CPU_TARGET_AVX2
+static inline void compare_32(uint8_t *a, uint8_t *b) {
+    __m256i va = _mm256_load_si256((const __m256i *)a);
+    __m256i vb = _mm256_load_si256((const __m256i *)b);
+    _mm256_store_si256((__m256i *)a, _mm256_min_epu8(va, vb));
+    _mm256_store_si256((__m256i *)b, _mm256_max_epu8(va, vb));
+}
+
+CPU_TARGET_AVX512
+static inline void compare_64(uint8_t *a, uint8_t *b) {
+    __m512i va = _mm512_load_si512((const void *)a);
+    __m512i vb = _mm512_load_si512((const void *)b);
+    _mm512_store_si512((void *)a, _mm512_min_epu8(va, vb));
+    _mm512_store_si512((void *)b, _mm512_max_epu8(va, vb));
+}
+#endif
+
+// the network over `lanes` blocks per pass: element i of every block is
+// transposed into one vector (lane = block), then every comparator runs on
+// whole vectors, so there are no data-dependent branches. 16 lanes with
+// sse2, 32 with avx2, 64 with avx-512
+#define DEFINE_BLOCK_MEDIANS(suffix, target, lanes)                               \
+    target static void block_medians_##suffix(const uint8_t *src, int stride,   \
+                                              int count, uint8_t *out) {        \
+        while (count > 0) {                                                       \
+            int n = count < (lanes) ? count : (lanes);                            \
+                                                                                  \
+            _Alignas(64) uint8_t v[BLOCK_AREA][lanes];                            \
+            for (int i = 0; i < BLOCK_AREA; i++) {                                \
+                const uint8_t *row =                                              \
+                    src + (size_t)(i / BLOCK_SIZE) * stride + i % BLOCK_SIZE;     \
+                for (int b = 0; b < n; b++) {                                     \
+                    v[i][b] = row[b * BLOCK_SIZE];                                \
+                }                                                                 \
+                for (int b = n; b < (lanes); b++) {                               \
+                    v[i][b] = 0;                                                  \
+                }                                                                 \
+            }                                                                     \
+                                                                                  \
+            for (int c = 0; c < network_pairs; c++) {                             \
+                compare_##lanes(v[network[c][0]], v[network[c][1]]);              \
+            }                                                                     \
+                                                                                  \
+            memcpy(out, v[BLOCK_AREA / 2], (size_t)n);                            \
+            src += (size_t)n * BLOCK_SIZE;                                        \
+            out += n;                                                             \
+            count -= n;                                                           \
+        }                                                                         \
+    }
+
+DEFINE_BLOCK_MEDIANS(portable, , 16)
+#ifdef CPU_DISPATCH_X86
+DEFINE_BLOCK_MEDIANS(avx2, CPU_TARGET_AVX2, 32)
+DEFINE_BLOCK_MEDIANS(avx512, CPU_TARGET_AVX512, 64)
+#endif
+
+void block_medians(const uint8_t *src, int stride, int count, uint8_t *out) {
+    pthread_once(&network_once, build_network);
+
+    switch (cpu_tier()) {
+#ifdef CPU_DISPATCH_X86
+    case CPU_TIER_AVX512: block_medians_avx512(src, stride, count, out); return;
+    case CPU_TIER_AVX2: block_medians_avx2(src, stride, count, out); return;
+#endif
+    default: block_medians_portable(src, stride, count, out); return;
+    }
+}
+
+#else
+
+// counting selection for block sizes the sorting network does not cover
+void block_medians(const uint8_t *src, int stride, int count, uint8_t *out) {
+    for (int b = 0; b < count; b++) {
+        uint16_t hist[256] = {0};
+        for (int by = 0; by < BLOCK_SIZE; by++) {
+            const uint8_t *row = src + (size_t)by * stride + (size_t)b * BLOCK_SIZE;
+            for (int bx = 0; bx < BLOCK_SIZE; bx++) {
+                hist[row[bx]]++;
+            }
+        }
+        int rank = BLOCK_AREA / 2;
+        int v = 0;
+        while (rank >= hist[v]) {
+            rank -= hist[v];
+            v++;
+        }
+        out[b] = (uint8_t)v;
+    }
+}
+
+#endif
+
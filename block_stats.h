@@ -0,0 +1,33 @@
+#ifndef BLOCK_STATS_H
+#define BLOCK_STATS_H
+
+#include <stdint.h>
+
+// side of the square analysis block, in pixels
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 8
+#endif
+#define BLOCK_AREA (BLOCK_SIZE * BLOCK_SIZE)
+
+// pixel sum and sum of squares of `count` non-overlapping blocks lying side
+// by side, the first one with its top-left pixel at src. integer only: sums
+// stay in 16-bit lanes (BLOCK_AREA * 255 fits) and squares in 32-bit lanes,
+// vectorized for the CPU tier
+void block_sums(const uint8_t *src, int stride, int count,
+                uint32_t *sum_out, uint32_t *sq_out);
+
+// calculate median of a small array (in-place bubble sort, fine for 8x8 blocks)
+// this is the reference every other median kernel has to agree with
+float calculate_small_median(float *arr, int size);
+
+// medians of `count` non-overlapping blocks lying side by side, the first one
+// with its top-left pixel at src; stride is the image row length in bytes.
+// returns the same element calculate_small_median picks (arr[BLOCK_AREA / 2]
+// of the sorted block). the kernel is chosen at compile time from BLOCK_SIZE:
+// a branch-free sorting network when BLOCK_AREA is a power of two, a counting
+// selection otherwise. the network runs as many blocks per pass as the CPU
+// tier's vectors have bytes
+void block_medians(const uint8_t *src, int stride, int count, uint8_t *out);
+
+#endif
+
@@ -0,0 +1,67 @@
+#include "cpu_dispatch.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *tier_names[CPU_TIER_COUNT] = {"portable", "avx2", "avx512"};
+
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+static cpu_tier_t detected = CPU_TIER_PORTABLE;
+static cpu_tier_t active = CPU_TIER_PORTABLE;
+
+static void detect(void) {
+#ifdef CPU_DISPATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+        detected = CPU_TIER_AVX2;
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+            detected = CPU_TIER_AVX512;
+        }
+    }
+#endif
+    active = detected;
+
+    const char *env = getenv("STEG_CPU_TIER");
+    if (env && *env) {
+        int tier = cpu_tier_parse(env);
+        if (tier < 0) {
+            printf("❌ unknown STEG_CPU_TIER '%s', using %s\n", env, tier_names[detected]);
+        } else if (tier < (int)detected) {
+            active = (cpu_tier_t)tier;
+        }
+    }
+}
+
+cpu_tier_t cpu_tier(void) {
+    pthread_once(&detect_once, detect);
+    return active;
+}
+
+cpu_tier_t cpu_tier_detected(void) {
+    pthread_once(&detect_once, detect);
+    return detected;
+}
+
+cpu_tier_t cpu_tier_force(cpu_tier_t tier) {
+    pthread_once(&detect_once, detect);
+    active = tier < detected ? tier : detected;
+    return active;
+}
+
+const char *cpu_tier_name(cpu_tier_t tier) {
+    return tier_names[tier];
+}
+
+int cpu_tier_parse(const char *name) {
+    if (strcmp(name, "auto") == 0) {
+        return CPU_TIER_COUNT - 1;
+    }
+    for (int t = 0; t < CPU_TIER_COUNT; t++) {
+        if (strcmp(name, tier_names[t]) == 0) {
+            return t;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,46 @@
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+// runtime choice between the builds of each hot kernel, so one binary runs
+// on every x86-64 CPU and still uses the widest vectors the one it lands on
+// has. the CPU is probed once; every kernel then reads cpu_tier() on entry
+
+// instruction set tiers, each a superset of the one before
+typedef enum {
+    CPU_TIER_PORTABLE = 0, // compiler baseline (SSE2 on x86-64)
+    CPU_TIER_AVX2 = 1,     // AVX2 + BMI2, Haswell / Zen and later
+    CPU_TIER_AVX512 = 2,   // AVX-512 F + BW, Skylake-SP / Zen 4 and later
+} cpu_tier_t;
+
+#define CPU_TIER_COUNT 3
+
+// the tiers above portable only exist on x86
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_DISPATCH_X86 1
+#define CPU_TARGET_AVX2 __attribute__((target("avx2,bmi2")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx2,bmi2")))
+#endif
+
+// body shared by every tier's build of a kernel: the wrappers carry the
+// target attribute and the compiler vectorizes the inlined copy for it
+#define CPU_KERNEL_BODY static inline __attribute__((always_inline))
+
+// tier the kernels run at: the best the CPU supports, lowered by the
+// STEG_CPU_TIER environment variable or cpu_tier_force()
+cpu_tier_t cpu_tier(void);
+
+// best tier the CPU supports
+cpu_tier_t cpu_tier_detected(void);
+
+// run at `tier` or the best the CPU supports, whichever is lower; returns
+// the tier now in use. not safe while a kernel is running
+cpu_tier_t cpu_tier_force(cpu_tier_t tier);
+
+// "portable", "avx2" or "avx512"
+const char *cpu_tier_name(cpu_tier_t tier);
+
+// tier of a name as cpu_tier_name() spells it, "auto" for the best one;
+// -1 if the name is unknown
+int cpu_tier_parse(const char *name);
+
+#endif
@@ -1,148 +1,837 @@
 #include "embedding.h"
+#include "thread_pool.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-void embed_message(uint8_t *image,
-                   int width,
-                   int height,
-                   int channels,
-                   const uint8_t *encrypted,
-                   size_t enc_len,
-                   const bool *mask) {
-    // prepare data: length (4 bytes big-endian) + encrypted message
-    size_t total_size = 4 + enc_len;
-    uint8_t *full_data = (uint8_t *)malloc(total_size);
-    if (!full_data) {
-        printf("❌ memory allocation failed in embed_message\n");
-        return;
-    }
+// payloads of at least this many bits are embedded/extracted on the pool
+#define PARALLEL_EMBED_MIN (1 << 23)
+// payload bits per pool task; a multiple of 8 so tasks never share a byte
+#define EMBED_CHUNK (1 << 21)
+
+// matrix-coded groups per pool task, a multiple of 8 so every task starts
+// on a byte of both the slot bits and the message
+#define MATRIX_TASK_GROUPS (1 << 15)
+// groups below which coding stays on the calling thread
+#define MATRIX_PARALLEL_MIN (1 << 17)
 
-    full_data[0] = (uint8_t)((enc_len >> 24) & 0xFF);
-    full_data[1] = (uint8_t)((enc_len >> 16) & 0xFF);
-    full_data[2] = (uint8_t)((enc_len >> 8) & 0xFF);
-    full_data[3] = (uint8_t)(enc_len & 0xFF);
-    memcpy(full_data + 4, encrypted, enc_len);
+// the LSB of each of 8 little-endian bytes
+#define LSB_LANES 0x0101010101010101ULL
 
-    int total_bits = (int)(total_size * 8);
-    int bit_index = 0;
+typedef struct {
+    uint8_t *image;
+    const embed_plan_t *plan;
+    bool bytes;      // slot i is image byte i (8-bit, one plane, no alpha)
+    uint8_t *data;   // payload bytes, data[0] holds bit `base`
+    size_t base;     // payload bit of data[0]'s MSB, a multiple of 8
+    size_t first;    // first payload bit of the job
+    size_t end;      // one past the last payload bit
+} bits_job_t;
 
-    printf("embedding %d bits into low-contrast regions...\n", total_bits);
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static uint64_t spread_table[256]; // bit 7 - i of v -> LSB of byte i
+// for 8 slot bits at group positions 8j .. 8j + 7 (MSB first): the XOR of
+// the low 3 position bits of the set ones, and in bit 3 their parity (so
+// 8j counts in once if odd)
+static uint8_t syndrome_table[256];
+
+// one payload byte -> the LSBs of 8 consecutive image bytes, MSB first
+static void spread_bytes(uint8_t *dst, const uint8_t *src, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++, dst += 8) {
+        uint64_t word;
+        memcpy(&word, dst, 8);
+        word = (word & ~LSB_LANES) | spread_table[src[i]];
+        memcpy(dst, &word, 8);
+    }
+}
+
+// and back: the multiply moves the LSB of byte i to bit 63 - i without
+// carries
+static void gather_bytes(uint8_t *dst, const uint8_t *src, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++, src += 8) {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        dst[i] = (uint8_t)(((word & LSB_LANES) * 0x8040201008040201ULL) >> 56);
+    }
+}
 
-    for (int y = 0; y < height && bit_index < total_bits; y++) {
-        for (int x = 0; x < width && bit_index < total_bits; x++) {
-            int pixel_idx = y * width + x;
-            if (!mask[pixel_idx]) {
-                continue;
+static void init_kernels(void) {
+    for (int v = 0; v < 256; v++) {
+        uint64_t spread = 0;
+        for (int i = 0; i < 8; i++) {
+            spread |= (uint64_t)((v >> (7 - i)) & 1) << (8 * i);
+        }
+        spread_table[v] = spread;
+
+        uint8_t syndrome = 0;
+        for (int i = 0; i < 8; i++) {
+            if ((v >> (7 - i)) & 1) {
+                syndrome ^= (uint8_t)(i | 8);
             }
+        }
+        syndrome_table[v] = syndrome;
+    }
+}
+
+embed_layout_t embed_layout_for(int channels, int depth) {
+    embed_layout_t layout;
+    layout.channels = channels;
+    layout.color_channels = channels == 2 || channels == 4 ? channels - 1 : channels;
+    layout.depth = depth;
+    layout.planes = depth == 16 ? EMBED_PLANES_16 : 1;
+    return layout;
+}
+
+int embed_format_depth(uint32_t format) {
+    return format >= EMBED_FORMAT_DEEP(2) && format <= EMBED_FORMAT_DEEP(EMBED_DEPTH_MAX)
+               ? (int)format + 1
+               : 1;
+}
+
+static bool layout_is_bytes(const embed_layout_t *layout) {
+    return layout->depth == 8 && layout->planes == 1 &&
+           layout->color_channels == layout->channels;
+}
+
+// slot i is image byte i for every run
+static bool plan_is_bytes(const embed_plan_t *plan) {
+    return layout_is_bytes(&plan->layout) && !plan->deep;
+}
 
-            for (int c = 0; c < channels && bit_index < total_bits; c++) {
-                int img_idx = pixel_idx * channels + c;
+// slot-by-slot access: the sample a slot of a run lies in and its bit
+// plane, stepped forward one slot at a time without dividing
+typedef struct {
+    size_t sample; // index into the image's samples
+    int channel;   // color channel of that sample
+    int plane;
+} slot_cursor_t;
 
-                int byte_idx = bit_index / 8;
-                int bit_pos = 7 - (bit_index % 8);
-                int bit = (full_data[byte_idx] >> bit_pos) & 1;
+static inline slot_cursor_t slot_cursor(const embed_layout_t *layout, const embed_run_t *run,
+                                        size_t slot) {
+    size_t color_sample = slot / (size_t)run->planes;
+    slot_cursor_t c;
+    c.channel = (int)(color_sample % (size_t)layout->color_channels);
+    c.sample = color_sample / (size_t)layout->color_channels * (size_t)layout->channels +
+               (size_t)c.channel;
+    c.plane = run->planes - 1 - (int)(slot % (size_t)run->planes);
+    return c;
+}
 
-                image[img_idx] = (uint8_t)((image[img_idx] & 0xFE) | bit);
+static inline void slot_next(slot_cursor_t *c, const embed_layout_t *layout, int planes) {
+    if (--c->plane >= 0) {
+        return;
+    }
+    c->plane = planes - 1;
+    c->sample++;
+    if (++c->channel == layout->color_channels) {
+        // past the alpha sample to the next pixel
+        c->channel = 0;
+        c->sample += (size_t)(layout->channels - layout->color_channels);
+    }
+}
 
-                bit_index++;
+// `count` bits of a sample from bit plane `low` up
+static inline void put_bits(uint8_t *image, const embed_layout_t *layout, size_t sample, int low,
+                            int count, unsigned value) {
+    unsigned mask = ((1u << count) - 1) << low;
+    if (layout->depth == 16) {
+        uint16_t *s = (uint16_t *)image + sample;
+        *s = (uint16_t)((*s & ~mask) | (value << low));
+    } else {
+        image[sample] = (uint8_t)((image[sample] & ~mask) | (value << low));
+    }
+}
+
+static inline unsigned get_bits(const uint8_t *image, const embed_layout_t *layout, size_t sample,
+                                int low, int count) {
+    unsigned v = layout->depth == 16 ? ((const uint16_t *)image)[sample] : image[sample];
+    return (v >> low) & ((1u << count) - 1);
+}
+
+// `count` (at most 8) payload bits from bit k of data on, MSB first; the
+// byte after k's is only read when the bits reach into it
+static inline unsigned take_bits(const uint8_t *data, size_t k, int count) {
+    int shift = (int)(k & 7);
+    unsigned window = (unsigned)data[k >> 3] << 8;
+    if (shift + count > 8) {
+        window |= data[(k >> 3) + 1];
+    }
+    return (window >> (16 - shift - count)) & ((1u << count) - 1);
+}
+
+// slot-by-slot write of payload bits [k, stop) into a run from `slot` on:
+// a whole sample's planes at once where the bits cover them, else bit by bit
+static void write_slots(const bits_job_t *job, const embed_run_t *run, size_t slot, size_t k,
+                        size_t stop) {
+    const embed_layout_t *layout = &job->plan->layout;
+    int planes = run->planes;
+    slot_cursor_t c = slot_cursor(layout, run, slot);
+    while (k < stop) {
+        if (c.plane == planes - 1 && stop - k >= (size_t)planes) {
+            put_bits(job->image, layout, c.sample, 0, planes, take_bits(job->data, k, planes));
+            k += (size_t)planes;
+            c.plane = 0;
+        } else {
+            put_bits(job->image, layout, c.sample, c.plane, 1,
+                     (job->data[k >> 3] >> (7 - (k & 7))) & 1);
+            k++;
+        }
+        slot_next(&c, layout, planes);
+    }
+}
+
+// slot-by-slot read of payload bits [k, stop) from a run, the counterpart
+// of write_slots; current_byte carries the bits of an unfinished data byte
+// in and out
+static uint8_t read_slots(const bits_job_t *job, const embed_run_t *run, size_t slot, size_t k,
+                          size_t stop, uint8_t current_byte) {
+    const embed_layout_t *layout = &job->plan->layout;
+    int planes = run->planes;
+    slot_cursor_t c = slot_cursor(layout, run, slot);
+    while (k < stop) {
+        int count = c.plane == planes - 1 && stop - k >= (size_t)planes ? planes : 1;
+        int low = c.plane + 1 - count;
+        unsigned v = get_bits(job->image, layout, c.sample, low, count);
+        for (int p = count - 1; p >= 0; p--, k++) {
+            current_byte = (uint8_t)((current_byte << 1) | ((v >> p) & 1));
+            if ((k & 7) == 7) {
+                job->data[k >> 3] = current_byte;
+                current_byte = 0;
             }
         }
+        c.plane = low;
+        slot_next(&c, layout, planes);
     }
+    return current_byte;
+}
 
-    printf("✓ embedded %d bits\n", bit_index);
-    free(full_data);
+// append a run, merging it into the previous one when the slots continue
+// with the same planes
+static bool plan_append(embed_plan_t *plan, size_t *alloc, size_t offset, size_t length,
+                        int planes) {
+    if (plan->run_count > 0) {
+        embed_run_t *last = &plan->runs[plan->run_count - 1];
+        if (last->planes == planes && last->offset + last->length == offset) {
+            last->length += length;
+            plan->capacity += length;
+            return true;
+        }
+    }
+    if (plan->run_count == *alloc) {
+        size_t grown = *alloc ? *alloc * 2 : 1024;
+        embed_run_t *runs = (embed_run_t *)realloc(plan->runs, grown * sizeof(embed_run_t));
+        if (!runs) {
+            return false;
+        }
+        plan->runs = runs;
+        *alloc = grown;
+    }
+    plan->runs[plan->run_count].offset = offset;
+    plan->runs[plan->run_count].length = length;
+    plan->runs[plan->run_count].start = plan->capacity;
+    plan->runs[plan->run_count].planes = planes;
+    plan->run_count++;
+    plan->capacity += length;
+    return true;
 }
 
-size_t extract_message(uint8_t *image,
-                       int width,
-                       int height,
-                       int channels,
-                       const bool *mask,
-                       uint8_t **encrypted_out) {
-    // phase 1: read 4-byte length header
-    uint8_t header[4];
-    int header_bits = 0;
-    int bits_in_byte = 0;
-    int byte_idx = 0;
-    uint8_t current_byte = 0;
-
-    for (int y = 0; y < height && header_bits < 32; y++) {
-        for (int x = 0; x < width && header_bits < 32; x++) {
-            int pixel_idx = y * width + x;
-            if (!mask[pixel_idx]) {
-                continue;
+embed_plan_t *embed_plan_create(const steg_mask_t *mask, const embed_layout_t *layout) {
+    embed_plan_t *plan = (embed_plan_t *)calloc(1, sizeof(embed_plan_t));
+    if (!plan) {
+        return NULL; // allocation failed
+    }
+    plan->layout = *layout;
+    size_t alloc = 0;
+    size_t per_pixel = (size_t)layout->color_channels * (size_t)layout->planes;
+
+    for (int y = 0; y < mask->height; y++) {
+        size_t row_offset = (size_t)y * (size_t)mask->width;
+
+        // runs of set bits, found a word at a time
+        int x = 0;
+        while ((x = steg_mask_next(mask, y, x)) >= 0) {
+            int end = steg_mask_run_end(mask, y, x);
+            if (!plan_append(plan, &alloc, (row_offset + (size_t)x) * per_pixel,
+                             (size_t)(end - x) * per_pixel, layout->planes)) {
+                embed_plan_free(plan);
+                return NULL; // allocation failed
             }
+            x = end;
+        }
+    }
 
-            for (int c = 0; c < channels && header_bits < 32; c++) {
-                int img_idx = pixel_idx * channels + c;
-                int bit = image[img_idx] & 1;
+    return plan;
+}
+
+embed_plan_t *embed_plan_create_blocks(const steg_mask_t *grid, int block_size,
+                                       int width, const embed_layout_t *layout,
+                                       const uint8_t *depths) {
+    embed_plan_t *plan = (embed_plan_t *)calloc(1, sizeof(embed_plan_t));
+    if (!plan) {
+        return NULL; // allocation failed
+    }
+    plan->layout = *layout;
+    size_t alloc = 0;
+    size_t row_samples = (size_t)width * (size_t)layout->color_channels;
+    size_t block_samples = (size_t)block_size * (size_t)layout->color_channels;
 
-                current_byte = (uint8_t)((current_byte << 1) | bit);
-                bits_in_byte++;
-                header_bits++;
+    for (int gy = 0; gy < grid->height; gy++) {
+        const uint8_t *row_depths = depths ? depths + (size_t)gy * grid->width : NULL;
+        for (int py = 0; py < block_size; py++) {
+            size_t row_offset = ((size_t)gy * block_size + py) * row_samples;
 
-                if (bits_in_byte == 8) {
-                    header[byte_idx++] = current_byte;
-                    current_byte = 0;
-                    bits_in_byte = 0;
+            // neighbouring set blocks of one depth make one run per pixel row
+            int bx = 0;
+            while ((bx = steg_mask_next(grid, gy, bx)) >= 0) {
+                int end = steg_mask_run_end(grid, gy, bx);
+                while (bx < end) {
+                    int planes = layout->planes;
+                    int next = end;
+                    if (row_depths) {
+                        planes += row_depths[bx] - 1;
+                        next = bx + 1;
+                        while (next < end && row_depths[next] == row_depths[bx]) {
+                            next++;
+                        }
+                        plan->deep |= planes != layout->planes;
+                    }
+                    size_t p = (size_t)planes;
+                    if (!plan_append(plan, &alloc, (row_offset + (size_t)bx * block_samples) * p,
+                                     (size_t)(next - bx) * block_samples * p, planes)) {
+                        embed_plan_free(plan);
+                        return NULL; // allocation failed
+                    }
+                    bx = next;
                 }
             }
         }
     }
 
-    size_t msg_len = ((size_t)header[0] << 24) |
-                     ((size_t)header[1] << 16) |
-                     ((size_t)header[2] << 8) |
-                     (size_t)header[3];
+    return plan;
+}
 
-    *encrypted_out = (uint8_t *)malloc(msg_len);
-    if (!*encrypted_out) {
-        printf("❌ memory allocation failed in extract_message\n");
-        return 0;
+void embed_plan_free(embed_plan_t *plan) {
+    if (!plan) {
+        return;
     }
+    free(plan->runs);
+    free(plan);
+}
 
-    // phase 2: walk the same masked pixels again to read the message bits
-    size_t bits_needed = msg_len * 8;
-    size_t bits_collected = 0;
-    size_t bits_seen = 0; // including header bits
+// run holding payload bit `bit`: the last one whose start is <= bit
+static size_t find_run(const embed_plan_t *plan, size_t bit) {
+    size_t lo = 0;
+    size_t hi = plan->run_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (plan->runs[mid].start <= bit) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-    bits_in_byte = 0;
-    byte_idx = 0;
-    current_byte = 0;
+// write payload bits [first, end) into their LSBs, MSB first; whole
+// payload bytes go through the spread kernel, partial ones bit by bit
+static void write_range(const bits_job_t *job, size_t first, size_t end) {
+    const embed_plan_t *plan = job->plan;
+    size_t r = find_run(plan, first);
+    size_t b = first;
 
-    for (int y = 0; y < height && bits_collected < bits_needed; y++) {
-        for (int x = 0; x < width && bits_collected < bits_needed; x++) {
-            int pixel_idx = y * width + x;
-            if (!mask[pixel_idx]) {
-                continue;
-            }
+    while (b < end) {
+        const embed_run_t *run = &plan->runs[r++];
+        size_t pos = b - run->start;
+        size_t n = run->length - pos;
+        if (n > end - b) {
+            n = end - b;
+        }
 
-            for (int c = 0; c < channels && bits_collected < bits_needed; c++) {
-                int img_idx = pixel_idx * channels + c;
-                int bit = image[img_idx] & 1;
+        size_t k = b - job->base;
+        if (!job->bytes) {
+            // alpha, 16-bit samples or several planes: slot by slot
+            write_slots(job, run, run->offset + pos, k, k + n);
+            b += n;
+            continue;
+        }
+        uint8_t *dst = job->image + run->offset + pos;
+        size_t stop = k + n;
+        for (; k < stop && (k & 7); k++, dst++) {
+            int bit = (job->data[k >> 3] >> (7 - (k & 7))) & 1;
+            *dst = (uint8_t)((*dst & 0xFE) | bit);
+        }
+        size_t whole = (stop - k) >> 3;
+        spread_bytes(dst, job->data + (k >> 3), whole);
+        dst += whole * 8;
+        k += whole * 8;
+        for (; k < stop; k++, dst++) {
+            int bit = (job->data[k >> 3] >> (7 - (k & 7))) & 1;
+            *dst = (uint8_t)((*dst & 0xFE) | bit);
+        }
+        b += n;
+    }
+}
 
-                if (bits_seen < 32) {
-                    bits_seen++;
-                    continue; // skip header bits
-                }
+// read payload bits [first, end) from their LSBs, MSB first. a byte cut
+// by first is completed on top of the bits already in data, one cut by end
+// is stored with its missing low bits clear
+static void read_range(const bits_job_t *job, size_t first, size_t end) {
+    const embed_plan_t *plan = job->plan;
+    size_t r = find_run(plan, first);
+    size_t b = first;
+    size_t head = (first - job->base) & 7;
+    uint8_t current_byte = head ? (uint8_t)(job->data[(first - job->base) >> 3] >> (8 - head)) : 0;
 
-                current_byte = (uint8_t)((current_byte << 1) | bit);
-                bits_in_byte++;
-                bits_collected++;
-                bits_seen++;
+    while (b < end) {
+        const embed_run_t *run = &plan->runs[r++];
+        size_t pos = b - run->start;
+        size_t n = run->length - pos;
+        if (n > end - b) {
+            n = end - b;
+        }
 
-                if (bits_in_byte == 8) {
-                    (*encrypted_out)[byte_idx++] = current_byte;
-                    current_byte = 0;
-                    bits_in_byte = 0;
-                }
+        // finish the byte the previous run started, gather whole bytes,
+        // then start the next one bit by bit
+        size_t k = b - job->base;
+        size_t stop = k + n;
+        if (!job->bytes) {
+            current_byte = read_slots(job, run, run->offset + pos, k, stop, current_byte);
+            b += n;
+            continue;
+        }
+        const uint8_t *src = job->image + run->offset + pos;
+        for (; k < stop && (k & 7); k++, src++) {
+            current_byte = (uint8_t)((current_byte << 1) | (*src & 1));
+            if ((k & 7) == 7) {
+                job->data[k >> 3] = current_byte;
+                current_byte = 0;
             }
         }
+        size_t whole = (stop - k) >> 3;
+        gather_bytes(job->data + (k >> 3), src, whole);
+        src += whole * 8;
+        k += whole * 8;
+        for (; k < stop; k++, src++) {
+            current_byte = (uint8_t)((current_byte << 1) | (*src & 1));
+        }
+        b += n;
+    }
+
+    size_t tail = (end - job->base) & 7;
+    if (tail && end > first) {
+        job->data[(end - job->base) >> 3] = (uint8_t)(current_byte << (8 - tail));
+    }
+}
+
+// bits [first, end) of the job's EMBED_CHUNK slice `index`: slices are
+// counted from base, so their edges fall on data byte boundaries
+static void chunk_range(const bits_job_t *job, int index, size_t *first, size_t *end) {
+    size_t start = job->base + ((job->first - job->base) / EMBED_CHUNK + (size_t)index) * EMBED_CHUNK;
+    *first = start > job->first ? start : job->first;
+    *end = start + EMBED_CHUNK < job->end ? start + EMBED_CHUNK : job->end;
+}
+
+// pool task: one EMBED_CHUNK slice, at the bit offset its index gives it
+static void write_chunk(void *arg, int index) {
+    const bits_job_t *job = (const bits_job_t *)arg;
+    size_t first, end;
+    chunk_range(job, index, &first, &end);
+    write_range(job, first, end);
+}
+
+static void read_chunk(void *arg, int index) {
+    const bits_job_t *job = (const bits_job_t *)arg;
+    size_t first, end;
+    chunk_range(job, index, &first, &end);
+    read_range(job, first, end);
+}
+
+// run a job serially or split into chunks on the pool; runs are disjoint
+// and chunks cover whole payload bytes, so the result is the same either
+// way. slot-by-slot layouts stay serial: a chunk edge may cut a sample
+static void run_bits_job(bits_job_t *job, pool_task_fn chunk,
+                         void (*range)(const bits_job_t *, size_t, size_t)) {
+    if (job->end <= job->first) {
+        return;
+    }
+    if (!job->bytes || job->end - job->first < PARALLEL_EMBED_MIN) {
+        range(job, job->first, job->end);
+        return;
+    }
+    size_t slices = (job->end - job->base - 1) / EMBED_CHUNK - (job->first - job->base) / EMBED_CHUNK + 1;
+    thread_pool_run(chunk, job, (int)slices);
+}
+
+// CRC-8, polynomial x^8 + x^2 + x + 1: the header is a handful of bytes,
+// so bit by bit
+static uint8_t header_crc(const uint8_t *bytes, size_t count) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < count; i++) {
+        crc ^= bytes[i];
+        for (int b = 0; b < 8; b++) {
+            crc = (uint8_t)(crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+size_t embed_header_size(size_t enc_len) {
+    size_t varint = 1;
+    for (size_t rest = enc_len >> 7; rest; rest >>= 7) {
+        varint++;
+    }
+    return EMBED_HEADER_FIXED_BYTES + varint + 1;
+}
+
+// the header of a message into header, embed_header_size(enc_len) bytes
+static void put_header(uint8_t *header, uint32_t format, int matrix, size_t enc_len) {
+    size_t n = 0;
+    header[n++] = EMBED_HEADER_MAGIC0;
+    header[n++] = EMBED_HEADER_MAGIC1;
+    header[n++] = EMBED_HEADER_VERSION;
+    header[n++] = (uint8_t)((format << EMBED_FLAGS_FORMAT_SHIFT) |
+                            (((uint32_t)matrix & EMBED_CODING_MASK) << EMBED_FLAGS_CODING_SHIFT));
+    size_t rest = enc_len;
+    do {
+        header[n++] = (uint8_t)((rest & 0x7F) | (rest > 0x7F ? 0x80 : 0));
+        rest >>= 7;
+    } while (rest);
+    header[n] = header_crc(header, n);
+}
+
+uint8_t *embed_frame(const uint8_t *encrypted, size_t enc_len, uint32_t format) {
+    size_t header_bytes = embed_header_size(enc_len);
+    uint8_t *frame = (uint8_t *)malloc(header_bytes + enc_len);
+    if (!frame) {
+        return NULL; // allocation failed
+    }
+
+    put_header(frame, format, 0, enc_len);
+    memcpy(frame + header_bytes, encrypted, enc_len);
+    return frame;
+}
+
+// a coding that exists, a message that is not empty, and room for both
+static bool header_fits(const embed_header_t *header, size_t max_slots) {
+    if ((header->matrix && header->matrix < EMBED_MATRIX_MIN) || header->length == 0 ||
+        header->length > SIZE_MAX / 8 / (((size_t)1 << EMBED_MATRIX_MAX) - 1)) {
+        return false;
+    }
+    size_t slots = embed_coded_slots(header->length, header->matrix);
+    return header->bytes * 8 <= max_slots && slots <= max_slots - header->bytes * 8;
+}
+
+// the big-endian length images from before the versioned header carry
+static embed_header_status_t parse_legacy(const uint8_t *bytes, size_t max_slots,
+                                          embed_header_t *header) {
+    header->version = 0;
+    header->matrix = 0;
+    header->length = ((size_t)bytes[0] << 24) |
+                     ((size_t)bytes[1] << 16) |
+                     ((size_t)bytes[2] << 8) |
+                     (size_t)bytes[3];
+    header->bytes = EMBED_LEGACY_HEADER_BYTES;
+    return header_fits(header, max_slots) ? EMBED_HEADER_FOUND : EMBED_HEADER_NONE;
+}
+
+embed_header_status_t embed_header_parse(const uint8_t *bytes, size_t avail, uint32_t format,
+                                         size_t max_slots, bool legacy, embed_header_t *header) {
+    if (avail < EMBED_HEADER_FIXED_BYTES) {
+        header->bytes = EMBED_HEADER_FIXED_BYTES;
+        return EMBED_HEADER_MORE;
+    }
+    if (bytes[0] != EMBED_HEADER_MAGIC0 || bytes[1] != EMBED_HEADER_MAGIC1) {
+        return legacy && format == EMBED_FORMAT_LEGACY ? parse_legacy(bytes, max_slots, header)
+                                                       : EMBED_HEADER_NONE;
+    }
+    uint32_t flags = bytes[3];
+    if (bytes[2] != EMBED_HEADER_VERSION || flags >> EMBED_FLAGS_FORMAT_SHIFT != format ||
+        (flags & 3) != 0) {
+        return EMBED_HEADER_NONE;
+    }
+
+    // the varint a byte at a time, then the CRC after it
+    size_t length = 0;
+    size_t n = EMBED_HEADER_FIXED_BYTES;
+    for (;; n++) {
+        if (7 * (n - EMBED_HEADER_FIXED_BYTES) >= sizeof(size_t) * 8) {
+            return EMBED_HEADER_NONE; // longer than any length here
+        }
+        if (n >= avail) {
+            header->bytes = n + 1;
+            return EMBED_HEADER_MORE;
+        }
+        length |= (size_t)(bytes[n] & 0x7F) << (7 * (n - EMBED_HEADER_FIXED_BYTES));
+        if (!(bytes[n] & 0x80)) {
+            break;
+        }
+    }
+    n++;
+    header->version = EMBED_HEADER_VERSION;
+    header->matrix = (int)((flags >> EMBED_FLAGS_CODING_SHIFT) & EMBED_CODING_MASK);
+    header->length = length;
+    header->bytes = n + 1;
+    if (n >= avail) {
+        return EMBED_HEADER_MORE;
+    }
+    return bytes[n] == header_crc(bytes, n) && header_fits(header, max_slots)
+               ? EMBED_HEADER_FOUND
+               : EMBED_HEADER_NONE;
+}
+
+bool embed_read_header(const uint8_t *image, const embed_plan_t *plan, uint32_t format,
+                       bool legacy, size_t max_slots, embed_header_t *header) {
+    uint8_t bytes[EMBED_HEADER_MAX_BYTES];
+    size_t read = 0;
+    embed_header_status_t status;
+    while ((status = embed_header_parse(bytes, read, format, max_slots, legacy, header)) ==
+           EMBED_HEADER_MORE) {
+        if (header->bytes * 8 > plan->capacity) {
+            return false;
+        }
+        extract_bits(image, plan, bytes, read * 8, header->bytes * 8);
+        read = header->bytes;
+    }
+    return status == EMBED_HEADER_FOUND;
+}
+
+void embed_plan_rebase(embed_plan_t *plan, size_t first) {
+    for (size_t r = 0; r < plan->run_count; r++) {
+        plan->runs[r].start += first;
+    }
+}
+
+void embed_bits(uint8_t *image, const embed_plan_t *plan, const uint8_t *data,
+                size_t first, size_t end) {
+    // write-only jobs never touch data
+    bits_job_t job = {image, plan, plan_is_bytes(plan), (uint8_t *)data, 0, first, end};
+    pthread_once(&kernels_once, init_kernels);
+    run_bits_job(&job, write_chunk, write_range);
+}
+
+void extract_bits(const uint8_t *image, const embed_plan_t *plan, uint8_t *data,
+                  size_t first, size_t end) {
+    // read-only jobs share the writable job type; image is never written
+    bits_job_t job = {(uint8_t *)image, plan, plan_is_bytes(plan), data, 0, first, end};
+    pthread_once(&kernels_once, init_kernels);
+    run_bits_job(&job, read_chunk, read_range);
+}
+
+size_t embed_coded_slots(size_t enc_len, int matrix) {
+    size_t bits = enc_len * 8;
+    if (matrix < EMBED_MATRIX_MIN) {
+        return bits;
+    }
+    size_t groups = (bits + (size_t)matrix - 1) / (size_t)matrix;
+    return groups * (((size_t)1 << matrix) - 1);
+}
+
+// syndrome of the group of n = 2^p - 1 slot bits from raw bit k on: the
+// first byte-sized piece covers positions 1 .. 7 (position 0 does not
+// exist), every later one the 8 positions 8j .. 8j + 7, one table lookup
+// each
+static unsigned group_syndrome(const uint8_t *raw, size_t k, int n) {
+    int first = n < 7 ? n : 7;
+    unsigned s = syndrome_table[take_bits(raw, k, first) << (7 - first)] & 7;
+    k += (size_t)first;
+    for (unsigned base = 8; base <= (unsigned)n; base += 8, k += 8) {
+        unsigned e = syndrome_table[take_bits(raw, k, 8)];
+        s ^= (e & 7) ^ (e & 8 ? base : 0);
+    }
+    return s;
+}
+
+// message bits [bit, bit + count) as a number, zeros past `total`
+static inline unsigned message_bits(const uint8_t *message, size_t bit, int count, size_t total) {
+    if (bit + (size_t)count <= total) {
+        return take_bits(message, bit, count);
+    }
+    int have = (int)(total - bit);
+    return take_bits(message, bit, have) << (count - have);
+}
+
+typedef struct {
+    uint8_t *raw;
+    uint8_t *message;
+    size_t bits;    // message bits
+    size_t groups;
+    int matrix;
+    atomic_size_t changes;
+} matrix_job_t;
+
+static void matrix_encode_range(matrix_job_t *job, size_t first, size_t end) {
+    int p = job->matrix;
+    int n = (1 << p) - 1;
+    size_t changes = 0;
+    for (size_t g = first; g < end; g++) {
+        size_t k = g * (size_t)n;
+        unsigned s = group_syndrome(job->raw, k, n) ^
+                     message_bits(job->message, g * (size_t)p, p, job->bits);
+        if (s) {
+            size_t flip = k + s - 1;
+            job->raw[flip >> 3] ^= (uint8_t)(0x80 >> (flip & 7));
+            changes++;
+        }
+    }
+    atomic_fetch_add(&job->changes, changes);
+}
+
+static void matrix_decode_range(matrix_job_t *job, size_t first, size_t end) {
+    int p = job->matrix;
+    int n = (1 << p) - 1;
+    for (size_t g = first; g < end; g++) {
+        unsigned s = group_syndrome(job->raw, g * (size_t)n, n);
+        size_t bit = g * (size_t)p;
+        for (int i = p - 1; i >= 0 && bit < job->bits; i--, bit++) {
+            job->message[bit >> 3] |= (uint8_t)(((s >> i) & 1) << (7 - (bit & 7)));
+        }
+    }
+}
+
+static void matrix_range(matrix_job_t *job, int index, size_t *first, size_t *end) {
+    *first = (size_t)index * MATRIX_TASK_GROUPS;
+    *end = *first + MATRIX_TASK_GROUPS < job->groups ? *first + MATRIX_TASK_GROUPS : job->groups;
+}
+
+static void matrix_encode_task(void *arg, int index) {
+    size_t first, end;
+    matrix_range((matrix_job_t *)arg, index, &first, &end);
+    matrix_encode_range((matrix_job_t *)arg, first, end);
+}
+
+static void matrix_decode_task(void *arg, int index) {
+    size_t first, end;
+    matrix_range((matrix_job_t *)arg, index, &first, &end);
+    matrix_decode_range((matrix_job_t *)arg, first, end);
+}
+
+// every group once, on the pool when there are many
+static void run_matrix_job(matrix_job_t *job, pool_task_fn task,
+                           void (*range)(matrix_job_t *, size_t, size_t)) {
+    pthread_once(&kernels_once, init_kernels);
+    if (job->groups < MATRIX_PARALLEL_MIN) {
+        range(job, 0, job->groups);
+        return;
+    }
+    thread_pool_run(task, job, (int)((job->groups + MATRIX_TASK_GROUPS - 1) / MATRIX_TASK_GROUPS));
+}
+
+size_t embed_matrix_encode(uint8_t *raw, const uint8_t *message, size_t bits, int matrix) {
+    matrix_job_t job = {raw, (uint8_t *)message, bits, (bits + (size_t)matrix - 1) / (size_t)matrix,
+                        matrix, 0};
+    run_matrix_job(&job, matrix_encode_task, matrix_encode_range);
+    return atomic_load(&job.changes);
+}
+
+void embed_matrix_decode(const uint8_t *raw, uint8_t *message, size_t bits, int matrix) {
+    // read-only jobs share the writable job type; raw is never written
+    matrix_job_t job = {(uint8_t *)raw, message, bits, (bits + (size_t)matrix - 1) / (size_t)matrix,
+                        matrix, 0};
+    memset(message, 0, (bits + 7) / 8);
+    run_matrix_job(&job, matrix_decode_task, matrix_decode_range);
+}
+
+void embed_message(uint8_t *image,
+                   const embed_plan_t *plan,
+                   const uint8_t *encrypted,
+                   size_t enc_len,
+                   uint32_t format,
+                   int matrix) {
+    if (matrix < EMBED_MATRIX_MIN) {
+        // prepare data: header + encrypted message
+        size_t total_size = embed_header_size(enc_len) + enc_len;
+        uint8_t *full_data = embed_frame(encrypted, enc_len, format);
+        if (!full_data) {
+            printf("❌ memory allocation failed in embed_message\n");
+            return;
+        }
+
+        size_t total_bits = total_size * 8;
+        if (total_bits > plan->capacity) {
+            total_bits = plan->capacity;
+        }
+
+        printf("embedding %zu bits into low-contrast regions...\n", total_bits);
+
+        embed_bits(image, plan, full_data, 0, total_bits);
+
+        printf("✓ embedded %zu bits\n", total_bits);
+        free(full_data);
+        return;
+    }
+
+    // matrix coded: the plain header, then the slots the message needs as
+    // they are, with the coding's flips applied, written back
+    size_t header_bytes = embed_header_size(enc_len);
+    size_t slots = embed_coded_slots(enc_len, matrix);
+    size_t total_bits = header_bytes * 8 + slots;
+    if (total_bits > plan->capacity) {
+        printf("❌ message needs %zu slots, the image has %zu\n", total_bits, plan->capacity);
+        return;
+    }
+    uint8_t *frame = (uint8_t *)malloc(header_bytes + (slots + 7) / 8);
+    if (!frame) {
+        printf("❌ memory allocation failed in embed_message\n");
+        return;
+    }
+    put_header(frame, format, matrix, enc_len);
+
+    printf("embedding %zu bits into %zu slots, matrix (1, %d, %d)...\n", enc_len * 8, slots,
+           (1 << matrix) - 1, matrix);
+
+    bits_job_t job = {image, plan, plan_is_bytes(plan), frame + header_bytes, header_bytes * 8,
+                      header_bytes * 8, total_bits};
+    pthread_once(&kernels_once, init_kernels);
+    run_bits_job(&job, read_chunk, read_range);
+    size_t changes = embed_matrix_encode(frame + header_bytes, encrypted, enc_len * 8, matrix);
+    embed_bits(image, plan, frame, 0, total_bits);
+
+    printf("✓ embedded %zu bits, %zu slots changed (%.3f per message bit)\n", enc_len * 8,
+           changes, enc_len ? (double)changes / (double)(enc_len * 8) : 0.0);
+    free(frame);
+}
+
+size_t extract_message(const uint8_t *image,
+                       const embed_plan_t *plan,
+                       uint32_t format,
+                       bool legacy,
+                       uint8_t **encrypted_out) {
+    *encrypted_out = NULL;
+    embed_header_t header;
+    if (!embed_read_header(image, plan, format, legacy, plan->capacity, &header)) {
+        return 0;
+    }
+    size_t msg_len = header.length;
+    int matrix = header.matrix;
+
+    // plain: the message itself; matrix coded: its slots, decoded after
+    size_t slots = embed_coded_slots(msg_len, matrix);
+    uint8_t *raw = (uint8_t *)malloc((slots + 7) / 8);
+    *encrypted_out = matrix ? (uint8_t *)malloc(msg_len) : raw;
+    if (!raw || !*encrypted_out) {
+        printf("❌ memory allocation failed in extract_message\n");
+        free(raw);
+        if (matrix) {
+            free(*encrypted_out);
+        }
+        *encrypted_out = NULL;
+        return 0;
+    }
+
+    // stops as soon as the announced length has been read
+    bits_job_t job = {(uint8_t *)image, plan, plan_is_bytes(plan), raw, header.bytes * 8,
+                      header.bytes * 8, header.bytes * 8 + slots};
+    pthread_once(&kernels_once, init_kernels);
+    run_bits_job(&job, read_chunk, read_range);
+    if (matrix) {
+        embed_matrix_decode(raw, *encrypted_out, msg_len * 8, matrix);
+        free(raw);
     }
 
     printf("✓ extracted %zu encrypted bytes\n", msg_len);
     return msg_len;
 }
-
@@ -5,24 +5,191 @@
 #include <stdbool.h>
 #include <stddef.h>
 
-// embed encrypted message into image using LSBs in low-contrast mask regions
+#include "mask.h"
+
+// payload header, always plain LSB in front of the message: the magic "SG",
+// a version byte, a flags byte (format in its top 3 bits, matrix coding in
+// the next 3, the low 2 zero), the message length as a base-128 varint (low
+// 7 bits first, top bit set on every byte but the last) and a CRC-8 of all
+// the bytes before it. 6 bytes for a message under 128 bytes; an image
+// without one fails the first 4 bytes, or the CRC, in a few dozen bits
+#define EMBED_HEADER_MAGIC0 0x53u
+#define EMBED_HEADER_MAGIC1 0x47u
+#define EMBED_HEADER_VERSION 1
+#define EMBED_HEADER_FIXED_BYTES 4 // magic, version, flags
+#define EMBED_HEADER_MAX_BYTES 15  // with a 10-byte varint
+#define EMBED_FLAGS_FORMAT_SHIFT 5
+#define EMBED_FLAGS_CODING_SHIFT 2
+#define EMBED_CODING_MASK 0x7u
+
+// the header of images written before the versioned one: the message
+// length as a 4-byte big-endian word, always through the full-byte
+// (EMBED_FORMAT_LEGACY) mask and without matrix coding
+#define EMBED_LEGACY_HEADER_BYTES 4
+
+// matrix coding (F5-style Hamming syndrome coding) with parameter p: the
+// message goes p bits at a time into groups of 2^p - 1 slots, whose
+// syndrome (XOR of the 1-based positions of the slots holding 1) is made
+// equal to those bits by flipping at most one slot. p = 3 writes 3 bits
+// into 7 slots with 7/8 changes on average where plain LSB makes 1.5. the
+// header itself is always plain; coding 0 is plain LSB
+#define EMBED_MATRIX_MIN 2
+#define EMBED_MATRIX_MAX 7
+
+// formats: which mask chose the embedding positions. the decoder recomputes
+// each candidate mask and only accepts a header carrying its format
+#define EMBED_FORMAT_LEGACY 0u // per-pixel mask, full-byte statistics
+#define EMBED_FORMAT_PIXELS 4u // per-pixel mask, LSB-invariant statistics
+#define EMBED_FORMAT_BLOCKS 5u // block grid, LSB-invariant statistics
+
+// k-LSB: block grid carrying up to k bit planes per sample (k = 2 ..
+// EMBED_DEPTH_MAX), each block as many as its local std allows, with
+// statistics blind to the k low planes. codes 1 to 3, which no header of
+// the older formats has
+#define EMBED_DEPTH_MAX 4
+#define EMBED_FORMAT_DEEP(k) ((uint32_t)(k) - 1u)
+
+// most bit planes per sample a format embeds in: k for EMBED_FORMAT_DEEP(k),
+// 1 for the others
+int embed_format_depth(uint32_t format);
+
+// low bit planes a 16-bit sample carries: it changes by at most 15/65535,
+// under a sixteenth of one 8-bit level
+#define EMBED_PLANES_16 4
+
+// which bits of an image carry payload. every pixel has color_channels *
+// planes bit slots, numbered pixel by pixel, then color sample by sample,
+// then from the highest carried plane down; a slot is one payload bit
+typedef struct {
+    int channels;       // interleaved samples per pixel
+    int color_channels; // the leading samples that carry bits; alpha never does
+    int depth;          // bits per sample: 8, or 16 for native-endian uint16_t samples
+    int planes;         // low bit planes carried per color sample
+} embed_layout_t;
+
+// the layout this tool embeds with: 1 (gray), 2 (gray + alpha), 3 (rgb) or
+// 4 (rgba) channels at 8 or 16 bits; one plane at 8 bits, EMBED_PLANES_16
+// at 16. alpha is left alone
+embed_layout_t embed_layout_for(int channels, int depth);
+
+// slots [offset, offset + length) carry one payload bit each, starting with
+// payload bit `start`. slots are numbered with the run's own planes per
+// sample, which is the layout's except in blocks given a depth. for 8-bit
+// samples with one plane and no alpha, slot i is simply image byte i
+typedef struct {
+    size_t offset;
+    size_t length;
+    size_t start; // exclusive prefix sum of the lengths before this run
+    int planes;
+} embed_run_t;
+
+// embedding plan: the mask turned into the ordered list of runs of bit
+// slots that embedding and extraction walk, built once per image
+typedef struct {
+    embed_run_t *runs;
+    size_t run_count;
+    size_t capacity; // total bits the plan can carry, header included
+    embed_layout_t layout;
+    bool deep;       // some runs carry more planes than the layout
+} embed_plan_t;
+
+// build the plan for an image of mask->width x mask->height pixels laid out
+// as `layout`; NULL if allocation failed
+embed_plan_t *embed_plan_create(const steg_mask_t *mask, const embed_layout_t *layout);
+
+// build the plan for a block grid (one bit per block_size x block_size
+// block) over an image `width` pixels wide: block rows top to bottom, each
+// as block_size pixel rows crossing its set blocks left to right. depths,
+// unless NULL, holds one entry per grid cell (row-major) giving a set
+// block's depth k: its samples carry k - 1 planes more than the layout's.
+// NULL if allocation failed
+embed_plan_t *embed_plan_create_blocks(const steg_mask_t *grid, int block_size,
+                                       int width, const embed_layout_t *layout,
+                                       const uint8_t *depths);
+
+void embed_plan_free(embed_plan_t *plan);
+
+// slots a message of enc_len bytes takes after the header with matrix
+// parameter `matrix` (0 = plain LSB, one slot per bit)
+size_t embed_coded_slots(size_t enc_len, int matrix);
+
+// embed encrypted message into image using the plan's bit slots, plain or
+// matrix coded (matrix 0 or EMBED_MATRIX_MIN .. EMBED_MATRIX_MAX), tagged
+// with an EMBED_FORMAT_*; large payloads are split across the thread pool
 void embed_message(uint8_t *image,
-                   int width,
-                   int height,
-                   int channels,
+                   const embed_plan_t *plan,
                    const uint8_t *encrypted,
                    size_t enc_len,
-                   const bool *mask);
-
-// extract encrypted message using the SAME mask pattern;
-// returns encrypted length and allocates *encrypted_out
-size_t extract_message(uint8_t *image,
-                       int width,
-                       int height,
-                       int channels,
-                       const bool *mask,
+                   uint32_t format,
+                   int matrix);
+
+// extract encrypted message using a plan built from the SAME mask pattern,
+// decoding the matrix coding its header names; returns encrypted length and
+// allocates *encrypted_out, 0 if there is no header of this format (a
+// legacy one only counts for EMBED_FORMAT_LEGACY with `legacy` set) or it
+// announces more data than the plan holds
+size_t extract_message(const uint8_t *image,
+                       const embed_plan_t *plan,
+                       uint32_t format,
+                       bool legacy,
                        uint8_t **encrypted_out);
 
-#endif
+// bytes of the header in front of a message of enc_len bytes
+size_t embed_header_size(size_t enc_len);
+
+// the bits embed_message writes without matrix coding: the header followed
+// by the message, embed_header_size(enc_len) + enc_len bytes; caller frees,
+// NULL if allocation failed
+uint8_t *embed_frame(const uint8_t *encrypted, size_t enc_len, uint32_t format);
+
+// a header as read back
+typedef struct {
+    int version;   // EMBED_HEADER_VERSION, 0 for a legacy header
+    int matrix;    // matrix coding, 0 for plain LSB
+    size_t length; // message bytes
+    size_t bytes;  // header bytes; the message slots follow
+} embed_header_t;
+
+typedef enum {
+    EMBED_HEADER_NONE, // no header of this format here
+    EMBED_HEADER_MORE, // read the first header->bytes bytes and parse again
+    EMBED_HEADER_FOUND,
+} embed_header_status_t;
 
+// parse the first `avail` header bytes read from an image, starting with
+// EMBED_HEADER_FIXED_BYTES; a versioned header must carry `format`, a
+// legacy one is only accepted when `legacy` is set, `format` is
+// EMBED_FORMAT_LEGACY and no versioned header starts there. either must fit
+// its message in max_slots slots
+embed_header_status_t embed_header_parse(const uint8_t *bytes, size_t avail, uint32_t format,
+                                         size_t max_slots, bool legacy, embed_header_t *header);
+
+// read and parse the header at the start of the plan's slots, its message
+// fitting in max_slots (the plan's capacity, or the whole image's when the
+// plan only covers the top of it); false if there is none
+bool embed_read_header(const uint8_t *image, const embed_plan_t *plan, uint32_t format,
+                       bool legacy, size_t max_slots, embed_header_t *header);
+
+// matrix coding on its own: raw holds the slot bits after the header, MSB
+// first. encode makes the first embed_coded_slots(bits / 8, matrix) of them
+// carry `bits` message bits and returns how many it flipped; decode reads
+// them back into message. large payloads are split across the thread pool
+size_t embed_matrix_encode(uint8_t *raw, const uint8_t *message, size_t bits, int matrix);
+void embed_matrix_decode(const uint8_t *raw, uint8_t *message, size_t bits, int matrix);
+
+// streaming: a plan built for one band of an image, made to carry payload
+// bits from `first` on (the bits the bands above it took)
+void embed_plan_rebase(embed_plan_t *plan, size_t first);
+
+// write payload bits [first, end) of data (bit 0 = MSB of data[0]) into the
+// slots of a plan rebased to first
+void embed_bits(uint8_t *image, const embed_plan_t *plan, const uint8_t *data,
+                size_t first, size_t end);
+
+// read payload bits [first, end) back into data; the bits of data before
+// first are kept, the ones of its last byte after end are cleared
+void extract_bits(const uint8_t *image, const embed_plan_t *plan, uint8_t *data,
+                  size_t first, size_t end);
+
+#endif
 
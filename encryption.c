@@ -1,4 +1,5 @@
 #include "encryption.h"
+#include "thread_pool.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -6,6 +7,46 @@
 // very simple xor stream based on key bytes
 // NOTE: this is for demonstration only and is NOT secure crypto
 
+// messages at least this long are xored in chunks on the worker pool
+#define PARALLEL_XOR_MIN (1 << 20)
+#define XOR_CHUNK (256 * 1024)
+
+typedef struct {
+    const uint8_t *src;
+    uint8_t *dst;
+    size_t len;
+    const char *key;
+    size_t key_len;
+} xor_job_t;
+
+// xor bytes [start, end) with the key stream, key index following the offset
+static void xor_range(const xor_job_t *job, size_t start, size_t end) {
+    size_t k = start % job->key_len;
+    for (size_t i = start; i < end; i++) {
+        job->dst[i] = job->src[i] ^ (uint8_t)job->key[k];
+        if (++k == job->key_len) {
+            k = 0;
+        }
+    }
+}
+
+static void xor_chunk(void *arg, int index) {
+    const xor_job_t *job = (const xor_job_t *)arg;
+    size_t start = (size_t)index * XOR_CHUNK;
+    size_t end = start + XOR_CHUNK < job->len ? start + XOR_CHUNK : job->len;
+    xor_range(job, start, end);
+}
+
+static void xor_with_key(const uint8_t *src, uint8_t *dst, size_t len,
+                         const char *key, size_t key_len) {
+    xor_job_t job = {src, dst, len, key, key_len};
+    if (len < PARALLEL_XOR_MIN) {
+        xor_range(&job, 0, len);
+        return;
+    }
+    thread_pool_run(xor_chunk, &job, (int)((len + XOR_CHUNK - 1) / XOR_CHUNK));
+}
+
 size_t encrypt_message(const char *message,
                        const char *key,
                        uint8_t **encrypted_out) {
@@ -21,10 +62,7 @@ size_t encrypt_message(const char *message,
     if (!*encrypted_out) {
         return 0; // allocation failed
     }
-    for (size_t i = 0; i < msg_len; i++) {
-        uint8_t k = (uint8_t)key[i % key_len];
-        (*encrypted_out)[i] = ((const uint8_t *)message)[i] ^ k;
-    }
+    xor_with_key((const uint8_t *)message, *encrypted_out, msg_len, key, key_len);
 
     return msg_len;
 }
@@ -43,10 +81,7 @@ char *decrypt_message(const uint8_t *encrypted,
     if (!plaintext) {
         return NULL; // allocation failed
     }
-    for (size_t i = 0; i < enc_len; i++) {
-        uint8_t k = (uint8_t)key[i % key_len];
-        plaintext[i] = (char)(encrypted[i] ^ k);
-    }
+    xor_with_key(encrypted, (uint8_t *)plaintext, enc_len, key, key_len);
     plaintext[enc_len] = '\0';
 
     return plaintext;
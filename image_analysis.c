@@ -1,57 +1,353 @@
 #include "image_analysis.h"
+#include "block_stats.h"
+#include "cpu_dispatch.h"
+#include "thread_pool.h"
 
-#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 
-#define NUM_THREADS 4
-#define BLOCK_SIZE 8
+// rows are split into 4 equal bands (the last one takes the remainder) and
+// blocks starting in the last BLOCK_SIZE rows of a band are never tested.
+// this used to be one band per thread; it is part of what the mask means
+// now, so decoding keeps finding the same pixels
+#define ANALYSIS_BANDS 4
 
+// analysis tiles: TILE_ROWS block rows by TILE_STRIPS block columns
+// (256 x 256 pixels), read with a halo of BLOCK_SIZE - 1 rows below because
+// blocks overlap vertically. a tile's integral images fit in L2
+#define TILE_ROWS 256
+#define TILE_STRIPS (256 / BLOCK_SIZE)
+
+// image rows converted to gray by one task
+#define GRAY_ROWS 64
+
+// mask rows written by one dilation task
+#define DILATE_ROWS 64
+
+// block-grid analysis: block rows per task, and blocks per kernel call
+#define GRID_ROWS 16
+#define GRID_CHUNK 64
+
+// thresholds of the low-contrast test: |median - global median| < 50 and
+// 5 < std < 20
+#define MEDIAN_DELTA_MAX 50
+#define STD_MAX 20
+#define STD_MIN 5
+
+// the std test is done exactly on integers by comparing
+// BLOCK_AREA * sum(v^2) - sum(v)^2 (= BLOCK_AREA^2 * variance) against the
+// squared thresholds scaled the same way
+#define SCALED_VAR(std) ((int64_t)(std) * (std) * BLOCK_AREA * BLOCK_AREA)
+
+// k-LSB depth of a passing block: the std each depth from 2 up starts at.
+// below the first a block keeps one plane
+static const int depth_std[] = {6, 9, 13};
+#define DEPTH_LEVELS ((int)(sizeof(depth_std) / sizeof(depth_std[0])) + 1)
+
+// the reference test runs on float sums; blocks whose scaled variance is this
+// close to a threshold are re-checked with the float formula so masks stay
+// identical (4 units of summed squared deviation, far above float error)
+#define VAR_RECHECK_MARGIN (4 * BLOCK_AREA)
+
+// sliding median histograms: 256 fine bins split into 16 coarse groups
+#define HIST_BINS 256
+#define HIST_COARSE_SHIFT 4
+#define HIST_COARSE_BINS (HIST_BINS >> HIST_COARSE_SHIFT)
+
+// per-column-strip histogram of the current block, slid down one row at a
+// time; counts never exceed BLOCK_AREA so bytes are enough below 16x16
+#if BLOCK_AREA < 256
+typedef uint8_t hist_count_t;
+#else
+typedef uint16_t hist_count_t;
+#endif
+
+typedef struct {
+    hist_count_t coarse[HIST_COARSE_BINS];
+    hist_count_t fine[HIST_BINS];
+} strip_hist_t;
+
+// block positions analysed by one task
+typedef struct {
+    int first_row;
+    int end_row;     // exclusive
+    int first_strip;
+    int end_strip;   // exclusive
+} tile_t;
+
+typedef struct {
+    const uint8_t *gray; // gray rows from gray_first on (all of them unless streaming)
+    steg_mask_t *mask;   // mask rows from mask_first on
+    int width;
+    int height;
+    int strips;          // block columns: x = 0, BLOCK_SIZE, ... < width - BLOCK_SIZE
+    int global_median;
+    uint8_t *accepted;   // strips entries per block row from accepted_first on,
+                         // 1 = block passed the test
+    int gray_first;
+    int accepted_first;
+    int mask_first;
+    tile_t *tiles;
+    int tile_count;
+    int tile_first;      // tile of analyze_region index 0
+    int dilate_first;    // pixel rows dilate_rows works on
+    int dilate_end;
+    int grid_first;      // block rows analyze_grid_rows works on
+    int grid_end;
+    uint8_t *depths;     // grid-shaped like mask, per set block its depth (NULL: none)
+    int max_depth;
+    bool reference;      // use the original per-block float statistics
+    atomic_bool failed;  // a task could not get its scratch memory
+} analysis_t;
+
+static inline const uint8_t *gray_row(const analysis_t *an, int y) {
+    return an->gray + (size_t)(y - an->gray_first) * an->width;
+}
+
+static inline uint8_t *accepted_row(const analysis_t *an, int y) {
+    return an->accepted + (size_t)(y - an->accepted_first) * an->strips;
+}
+
+// one pool thread's histogram, on cache lines of its own so threads
+// counting at the same time never share one
 typedef struct {
-    uint8_t *image;
+    _Alignas(64) uint64_t bins[HIST_BINS];
+} worker_hist_t;
+
+// converts one row of pixels to gray, clearing the sample bits not in keep
+typedef void (*gray_row_fn)(const uint8_t *src, uint8_t *gray, int width, uint8_t keep);
+
+// rgb -> gray conversion plus histogram, GRAY_ROWS rows per task
+typedef struct {
+    const uint8_t *image;
     uint8_t *gray;
-    bool *mask;
     int width;
     int height;
     int channels;
-    int start_row;
-    int end_row;
-    float global_median;
-} thread_data_t;
-
-// calculate median of a small array (in-place bubble sort, fine for 8x8 blocks)
-static float calculate_small_median(float *arr, int size) {
-    for (int i = 0; i < size - 1; i++) {
-        for (int j = 0; j < size - i - 1; j++) {
-            if (arr[j] > arr[j + 1]) {
-                float temp = arr[j];
-                arr[j] = arr[j + 1];
-                arr[j + 1] = temp;
-            }
-        }
+    int depth;
+    gray_row_fn row;      // kernel for this channel count, NULL = generic loop
+    uint8_t keep;         // bits of each sample the gray value is made from
+    worker_hist_t *hists; // one per pool thread, summed afterwards
+} gray_job_t;
+
+// per-thread scratch, kept between calls so pool threads allocate it once
+typedef struct {
+    uint32_t *sat;       // integral images: sums, then squares
+    strip_hist_t *hists; // one sliding histogram per block column of a tile
+} scratch_t;
+
+// integral images of one tile (plus halo), starting at image row first_row
+// and column first_col
+typedef struct {
+    const uint32_t *sum;
+    const uint32_t *sq;
+    int stride;
+    int first_row;
+    int first_col;
+} integral_t;
+
+#define SAT_STRIDE (TILE_STRIPS * BLOCK_SIZE + 1)
+#define SAT_ENTRIES ((TILE_ROWS + BLOCK_SIZE) * SAT_STRIDE)
+
+static _Thread_local scratch_t scratch;
+
+// add (delta = 1) or remove (delta = -1) one row of a block column
+static void strip_hist_update(strip_hist_t *hist, const uint8_t *row, int delta) {
+    for (int bx = 0; bx < BLOCK_SIZE; bx++) {
+        uint8_t v = row[bx];
+        hist->fine[v] = (hist_count_t)(hist->fine[v] + delta);
+        hist->coarse[v >> HIST_COARSE_SHIFT] =
+            (hist_count_t)(hist->coarse[v >> HIST_COARSE_SHIFT] + delta);
+    }
+}
+
+// median of the block held in the histogram; same element the sorted
+// array lookup arr[size / 2] picks, found in at most 32 bin visits
+static int strip_hist_median(const strip_hist_t *hist) {
+    int rank = BLOCK_AREA / 2;
+    int c = 0;
+    while (rank >= hist->coarse[c]) {
+        rank -= hist->coarse[c];
+        c++;
+    }
+    int v = c << HIST_COARSE_SHIFT;
+    while (rank >= hist->fine[v]) {
+        rank -= hist->fine[v];
+        v++;
     }
-    return arr[size / 2];
+    return v;
 }
 
-// calculate global median for grayscale image using histogram (0-255)
-static float calculate_global_median(const uint8_t *gray, int width, int height) {
-    unsigned long hist[256] = {0};
-    unsigned long total = (unsigned long)width * (unsigned long)height;
+// gray value of a pixel: (r + g + b) / 3 of its first three samples (any
+// fourth is alpha), or its first sample when it has fewer. the divide is a
+// multiply by 65536 / 3 rounded up, exact for sums up to 765
+#define GRAY_OF(px, channels, keep)                                               \
+    ((channels) >= 3                                                              \
+         ? (uint8_t)((((unsigned)((px)[0] & (keep)) + ((px)[1] & (keep)) +       \
+                       ((px)[2] & (keep))) * 21846u) >> 16)                      \
+         : (uint8_t)((px)[0] & (keep)))
+
+// GRAY_OF for native-endian 16-bit samples, from their high bytes
+#define GRAY16_OF(px, channels, keep)                                             \
+    ((channels) >= 3                                                              \
+         ? (uint8_t)(((((px)[0] >> 8) & (keep)) + (((px)[1] >> 8) & (keep)) +    \
+                      (((px)[2] >> 8) & (keep))) * 21846u >> 16)                 \
+         : (uint8_t)(((px)[0] >> 8) & (keep)))
+
+// one kernel per common channel count and CPU tier: with the stride a
+// constant the loop is fixed-trip per pixel and the compiler vectorizes it
+// for the tier's vector width
+#define DEFINE_GRAY_ROW(tier, target, channels)                                   \
+    target static void gray_row_##channels##_##tier(const uint8_t *restrict src, \
+                                                    uint8_t *restrict gray,      \
+                                                    int width, uint8_t keep) {   \
+        for (int x = 0; x < width; x++) {                                         \
+            gray[x] = GRAY_OF(src + (size_t)x * (channels), channels, keep);      \
+        }                                                                         \
+    }
+
+#define DEFINE_GRAY_KERNELS(tier, target)                                            \
+    DEFINE_GRAY_ROW(tier, target, 1)                                              \
+    DEFINE_GRAY_ROW(tier, target, 2)                                              \
+    DEFINE_GRAY_ROW(tier, target, 3)                                              \
+    DEFINE_GRAY_ROW(tier, target, 4)
+
+#define GRAY_KERNELS_OF(tier) \
+    {gray_row_1_##tier, gray_row_2_##tier, gray_row_3_##tier, gray_row_4_##tier}
+
+DEFINE_GRAY_KERNELS(portable, )
+#ifdef CPU_DISPATCH_X86
+DEFINE_GRAY_KERNELS(avx2, CPU_TARGET_AVX2)
+DEFINE_GRAY_KERNELS(avx512, CPU_TARGET_AVX512)
+
+static const gray_row_fn gray_kernels[CPU_TIER_COUNT][4] = {
+    GRAY_KERNELS_OF(portable),
+    GRAY_KERNELS_OF(avx2),
+    GRAY_KERNELS_OF(avx512),
+};
+#else
+// cpu_tier() never leaves portable here
+static const gray_row_fn gray_kernels[1][4] = {GRAY_KERNELS_OF(portable)};
+#endif
+
+// specialised kernel for a channel count at the CPU tier, NULL for unusual
+// channel counts
+static gray_row_fn gray_row_for(int channels) {
+    if (channels < 1 || channels > 4) {
+        return NULL;
+    }
+    return gray_kernels[cpu_tier()][channels - 1];
+}
+
+// pool task: gray rows of one GRAY_ROWS band and their histogram, counted
+// while the row is still in cache and added to this thread's bins
+static void gray_band(void *arg, int index) {
+    gray_job_t *job = (gray_job_t *)arg;
+    int first = index * GRAY_ROWS;
+    int end = first + GRAY_ROWS < job->height ? first + GRAY_ROWS : job->height;
+
+    // four interleaved histograms so repeated values do not serialize on
+    // one counter
+    uint32_t local[4][HIST_BINS];
+    memset(local, 0, sizeof(local));
+
+    for (int y = first; y < end; y++) {
+        uint8_t *row = job->gray + (size_t)y * job->width;
+        const uint8_t *src = job->image + (size_t)y * job->width * job->channels * (job->depth / 8);
+        if (job->depth == 16) {
+            const uint16_t *samples = (const uint16_t *)src;
+            for (int x = 0; x < job->width; x++) {
+                row[x] = GRAY16_OF(samples + (size_t)x * job->channels, job->channels, job->keep);
+            }
+        } else if (job->row) {
+            job->row(src, row, job->width, job->keep);
+        } else {
+            for (int x = 0; x < job->width; x++) {
+                row[x] = GRAY_OF(src + (size_t)x * job->channels, job->channels, job->keep);
+            }
+        }
+
+        int x = 0;
+        for (; x + 4 <= job->width; x += 4) {
+            local[0][row[x]]++;
+            local[1][row[x + 1]]++;
+            local[2][row[x + 2]]++;
+            local[3][row[x + 3]]++;
+        }
+        for (; x < job->width; x++) {
+            local[0][row[x]]++;
+        }
+    }
 
-    for (int i = 0; i < width * height; i++) {
-        hist[gray[i]]++;
+    uint64_t *bins = job->hists[thread_pool_worker_id()].bins;
+    for (int v = 0; v < HIST_BINS; v++) {
+        bins[v] += (uint64_t)local[0][v] + local[1][v] + local[2][v] + local[3][v];
     }
+}
 
-    unsigned long mid = total / 2;
-    unsigned long cum = 0;
-    for (int v = 0; v < 256; v++) {
+int gray_histogram_median(const uint64_t *hist, uint64_t total) {
+    uint64_t mid = total / 2;
+    uint64_t cum = 0;
+    for (int v = 0; v < HIST_BINS; v++) {
         cum += hist[v];
         if (cum >= mid) {
-            return (float)v;
+            return v;
+        }
+    }
+    return 0;
+}
+
+bool grayscale_rows(const uint8_t *pixels,
+                    int width,
+                    int rows,
+                    int channels,
+                    int depth,
+                    int invariant_planes,
+                    uint8_t *gray,
+                    uint64_t *hist) {
+    int workers = thread_pool_size();
+    worker_hist_t *hists =
+        (worker_hist_t *)aligned_alloc(_Alignof(worker_hist_t), (size_t)workers * sizeof(worker_hist_t));
+    if (!hists) {
+        return false; // allocation failed
+    }
+    memset(hists, 0, (size_t)workers * sizeof(worker_hist_t));
+
+    // a 16-bit sample's high byte only loses bits to planes above the 8th
+    int planes = depth == 16 ? (invariant_planes > 8 ? invariant_planes - 8 : 0) : invariant_planes;
+    gray_job_t job = {pixels, gray, width, rows, channels, depth == 16 ? 16 : 8,
+                      gray_row_for(channels), (uint8_t)(0xFF << planes), hists};
+    thread_pool_run(gray_band, &job, (rows + GRAY_ROWS - 1) / GRAY_ROWS);
+
+    // reduce the per-thread bins
+    for (int w = 0; w < workers && hist; w++) {
+        for (int v = 0; v < HIST_BINS; v++) {
+            hist[v] += hists[w].bins[v];
         }
     }
-    return 0.0f;
+    free(hists);
+    return true;
+}
+
+uint8_t *grayscale_with_median(const uint8_t *image,
+                               int width,
+                               int height,
+                               int channels,
+                               int depth,
+                               int invariant_planes,
+                               int *median_out) {
+    uint8_t *gray = (uint8_t *)malloc((size_t)width * (size_t)height);
+    uint64_t hist[HIST_BINS] = {0};
+    if (!gray ||
+        !grayscale_rows(image, width, height, channels, depth, invariant_planes, gray, hist)) {
+        free(gray);
+        return NULL; // allocation failed
+    }
+
+    *median_out = gray_histogram_median(hist, (uint64_t)width * (uint64_t)height);
+    return gray;
 }
 
 // calculate standard deviation
@@ -64,109 +360,681 @@ static float calculate_std(float *arr, int size, float mean) {
     return sqrtf(sum / (float)size);
 }
 
-// thread worker for analyzing image regions
-static void *analyze_region(void *arg) {
-    thread_data_t *data = (thread_data_t *)arg;
+// copy the block at (x, y) out of the gray image as floats
+static void extract_block(const analysis_t *an, int x, int y, float *block) {
+    int idx = 0;
+    for (int by = 0; by < BLOCK_SIZE; by++) {
+        const uint8_t *row = gray_row(an, y + by) + x;
+        for (int bx = 0; bx < BLOCK_SIZE; bx++) {
+            block[idx++] = (float)row[bx];
+        }
+    }
+}
+
+// float block statistics, exactly as the original per-block loop computed them
+static float reference_block_std(const analysis_t *an, int x, int y) {
+    float block[BLOCK_AREA];
+    extract_block(an, x, y, block);
+
+    float sum = 0.0f;
+    for (int i = 0; i < BLOCK_AREA; i++) {
+        sum += block[i];
+    }
+    float mean = sum / (float)BLOCK_AREA;
+    return calculate_std(block, BLOCK_AREA, mean);
+}
 
-    for (int y = data->start_row; y < data->end_row - BLOCK_SIZE; y++) {
-        for (int x = 0; x < data->width - BLOCK_SIZE; x += BLOCK_SIZE) {
-            // extract block
-            float block[BLOCK_SIZE * BLOCK_SIZE];
-            int idx = 0;
+// build integral images (sum and sum of squares) for the rows x columns
+// rectangle at (first_col, first_row); entry (r, c) holds the totals of the
+// part above and left of it. each row first adds its pixels to running
+// column totals, a loop along the row that vectorizes, leaving only the
+// prefix over those totals serial. unsigned wrap-around is
+// fine because every block total fits in 32 bits and the four-lookup
+// difference cancels the rest
+static void build_integral_images(const analysis_t *an, uint32_t *sum, uint32_t *sq,
+                                  int first_row, int first_col, int rows, int cols) {
+    int stride = cols + 1;
+    uint32_t col_sum[TILE_STRIPS * BLOCK_SIZE];
+    uint32_t col_sq[TILE_STRIPS * BLOCK_SIZE];
+
+    memset(sum, 0, (size_t)stride * sizeof(uint32_t));
+    memset(sq, 0, (size_t)stride * sizeof(uint32_t));
+    memset(col_sum, 0, (size_t)cols * sizeof(uint32_t));
+    memset(col_sq, 0, (size_t)cols * sizeof(uint32_t));
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *src = gray_row(an, first_row + r) + first_col;
+        uint32_t *sum_out = sum + (size_t)(r + 1) * stride;
+        uint32_t *sq_out = sq + (size_t)(r + 1) * stride;
+
+        for (int x = 0; x < cols; x++) {
+            uint32_t v = src[x];
+            col_sum[x] += v;
+            col_sq[x] += v * v;
+        }
+        sum_out[0] = 0;
+        sq_out[0] = 0;
+        for (int x = 0; x < cols; x++) {
+            sum_out[x + 1] = sum_out[x] + col_sum[x];
+            sq_out[x + 1] = sq_out[x] + col_sq[x];
+        }
+    }
+}
+
+// std test from a block's pixel sum s and sum of squares q, integer only;
+// values next to a threshold are settled by the float reference at (x, y)
+static bool block_std_ok(const analysis_t *an, uint32_t s, uint32_t q, int x, int y) {
+    int64_t var = (int64_t)BLOCK_AREA * q - (int64_t)s * s;
+
+    if (llabs(var - SCALED_VAR(STD_MAX)) <= VAR_RECHECK_MARGIN ||
+        llabs(var - SCALED_VAR(STD_MIN)) <= VAR_RECHECK_MARGIN) {
+        float local_std = reference_block_std(an, x, y);
+        return local_std < STD_MAX && local_std > STD_MIN;
+    }
+    return var < SCALED_VAR(STD_MAX) && var > SCALED_VAR(STD_MIN);
+}
+
+// bit planes a passing block with pixel sum s and sum of squares q can
+// carry, at most max_depth. exact integers only: the decoder computes the
+// same sums, so it finds the same depth
+static int block_depth(uint32_t s, uint32_t q, int max_depth) {
+    int64_t var = (int64_t)BLOCK_AREA * q - (int64_t)s * s;
+    int depth = 1;
+    while (depth < max_depth && depth < DEPTH_LEVELS && var >= SCALED_VAR(depth_std[depth - 1])) {
+        depth++;
+    }
+    return depth;
+}
+
+// std test for the block with its top-left corner at image (x, y):
+// four lookups per sum and integer compares, no sqrt
+static bool integral_block_std_ok(const analysis_t *an, const integral_t *sat, int x, int y) {
+    size_t top = (size_t)(y - sat->first_row) * sat->stride + (size_t)(x - sat->first_col);
+    size_t bottom = top + (size_t)BLOCK_SIZE * sat->stride;
+
+    uint32_t s = sat->sum[bottom + BLOCK_SIZE] - sat->sum[top + BLOCK_SIZE] -
+                 sat->sum[bottom] + sat->sum[top];
+    uint32_t q = sat->sq[bottom + BLOCK_SIZE] - sat->sq[top + BLOCK_SIZE] -
+                 sat->sq[bottom] + sat->sq[top];
+    return block_std_ok(an, s, q, x, y);
+}
+
+// make sure this thread has its tile scratch
+static bool ensure_scratch(void) {
+    if (!scratch.sat) {
+        scratch.sat = (uint32_t *)malloc((size_t)SAT_ENTRIES * 2 * sizeof(uint32_t));
+    }
+    if (!scratch.hists) {
+        scratch.hists = (strip_hist_t *)malloc(TILE_STRIPS * sizeof(strip_hist_t));
+    }
+    return scratch.sat && scratch.hists;
+}
+
+// original per-block analysis: float copy, bubble-sort median, float std.
+// kept as the reference the fast path is checked against
+static bool reference_block_ok(const analysis_t *an, int x, int y) {
+    float block[BLOCK_AREA];
+    extract_block(an, x, y, block);
+
+    // calculate statistics
+    float sum = 0.0f;
+    for (int i = 0; i < BLOCK_AREA; i++) {
+        sum += block[i];
+    }
+    float mean = sum / (float)BLOCK_AREA;
+
+    float local_median = calculate_small_median(block, BLOCK_AREA);
+    float local_std = calculate_std(block, BLOCK_AREA, mean);
+
+    // check if low contrast
+    return fabsf(local_median - (float)an->global_median) < MEDIAN_DELTA_MAX &&
+           local_std < STD_MAX && local_std > STD_MIN;
+}
+
+static void analyze_tile_reference(analysis_t *an, const tile_t *tile) {
+    for (int y = tile->first_row; y < tile->end_row; y++) {
+        uint8_t *accepted = accepted_row(an, y);
+        for (int s = tile->first_strip; s < tile->end_strip; s++) {
+            accepted[s] = reference_block_ok(an, s * BLOCK_SIZE, y);
+        }
+    }
+}
+
+// pool task: test every block position of one tile
+static void analyze_region(void *arg, int index) {
+    analysis_t *an = (analysis_t *)arg;
+    const tile_t *tile = &an->tiles[an->tile_first + index];
+
+    if (an->reference) {
+        analyze_tile_reference(an, tile);
+        return;
+    }
+    if (!ensure_scratch()) {
+        atomic_store(&an->failed, true);
+        return;
+    }
 
-            for (int by = 0; by < BLOCK_SIZE; by++) {
-                for (int bx = 0; bx < BLOCK_SIZE; bx++) {
-                    int py = y + by;
-                    int px = x + bx;
-                    block[idx++] = (float)data->gray[py * data->width + px];
+    int first_col = tile->first_strip * BLOCK_SIZE;
+    int cols = (tile->end_strip - tile->first_strip) * BLOCK_SIZE;
+    int rows = tile->end_row - tile->first_row + BLOCK_SIZE - 1; // with halo
+    build_integral_images(an, scratch.sat, scratch.sat + SAT_ENTRIES,
+                          tile->first_row, first_col, rows, cols);
+    integral_t sat = {scratch.sat, scratch.sat + SAT_ENTRIES, cols + 1,
+                      tile->first_row, first_col};
+
+    // prime one histogram per block column with the tile's first block row
+    strip_hist_t *hists = scratch.hists;
+    for (int s = tile->first_strip; s < tile->end_strip; s++) {
+        strip_hist_t *hist = &hists[s - tile->first_strip];
+        memset(hist, 0, sizeof(*hist));
+        for (int by = 0; by < BLOCK_SIZE; by++) {
+            strip_hist_update(hist,
+                              gray_row(an, tile->first_row + by) + s * BLOCK_SIZE,
+                              1);
+        }
+    }
+
+    for (int y = tile->first_row; y < tile->end_row; y++) {
+        const uint8_t *leaving = gray_row(an, y);
+        const uint8_t *entering = leaving + (size_t)BLOCK_SIZE * an->width;
+        uint8_t *accepted = accepted_row(an, y);
+        bool slide = y + 1 < tile->end_row;
+
+        for (int s = tile->first_strip; s < tile->end_strip; s++) {
+            int x = s * BLOCK_SIZE;
+            strip_hist_t *hist = &hists[s - tile->first_strip];
+
+            // variance first: it is four lookups, the median a histogram walk
+            bool ok = false;
+            if (integral_block_std_ok(an, &sat, x, y)) {
+                int local_median = strip_hist_median(hist);
+
+                // check if low contrast
+                ok = abs(local_median - an->global_median) < MEDIAN_DELTA_MAX;
+            }
+            accepted[s] = ok;
+
+            // move this column's window down one row
+            if (slide) {
+                strip_hist_update(hist, leaving + x, -1);
+                strip_hist_update(hist, entering + x, 1);
+            }
+        }
+    }
+}
+
+// pool task: a mask pixel is set when any accepted block covers it, i.e. a
+// block in its column strip starting up to BLOCK_SIZE - 1 rows above it.
+// tasks own whole rows, and mask rows never share words
+static void dilate_rows(void *arg, int index) {
+    analysis_t *an = (analysis_t *)arg;
+    int first = an->dilate_first + index * DILATE_ROWS;
+    int end = first + DILATE_ROWS < an->dilate_end ? first + DILATE_ROWS : an->dilate_end;
+
+    for (int py = first; py < end; py++) {
+        int top = py - (BLOCK_SIZE - 1) > 0 ? py - (BLOCK_SIZE - 1) : 0;
+        int run_start = -1;
+
+        for (int s = 0; s <= an->strips; s++) {
+            uint8_t covered = 0;
+            if (s < an->strips) {
+                for (int y = top; y <= py; y++) {
+                    covered |= accepted_row(an, y)[s];
                 }
             }
 
-            // calculate statistics
-            float sum = 0.0f;
-            for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++) {
-                sum += block[i];
+            // write covered strips as runs of bits
+            if (covered && run_start < 0) {
+                run_start = s;
+            } else if (!covered && run_start >= 0) {
+                steg_mask_set_run(an->mask, py - an->mask_first, run_start * BLOCK_SIZE,
+                                  (s - run_start) * BLOCK_SIZE);
+                run_start = -1;
             }
-            float mean = sum / (float)(BLOCK_SIZE * BLOCK_SIZE);
-
-            float local_median = calculate_small_median(block, BLOCK_SIZE * BLOCK_SIZE);
-            float local_std = calculate_std(block, BLOCK_SIZE * BLOCK_SIZE, mean);
-
-            // check if low contrast
-            if (fabsf(local_median - data->global_median) < 50.0f &&
-                local_std < 20.0f && local_std > 5.0f) {
-                // mark block as suitable
-                for (int by = 0; by < BLOCK_SIZE; by++) {
-                    for (int bx = 0; bx < BLOCK_SIZE; bx++) {
-                        int py = y + by;
-                        int px = x + bx;
-                        data->mask[py * data->width + px] = true;
+        }
+    }
+}
+
+// dilate pixel rows [first, end) into the mask
+static void dilate_range(analysis_t *an, int first, int end) {
+    an->dilate_first = first;
+    an->dilate_end = end;
+    thread_pool_run(dilate_rows, an, (end - first + DILATE_ROWS - 1) / DILATE_ROWS);
+}
+
+// append the tiles covering the tested block rows in [first_row, end_row)
+static void add_tiles(analysis_t *an, int first_row, int end_row) {
+    int rows_per_band = an->height / ANALYSIS_BANDS;
+    for (int b = 0; b < ANALYSIS_BANDS; b++) {
+        int band_start = b * rows_per_band;
+        int band_end = (b == ANALYSIS_BANDS - 1) ? an->height : (b + 1) * rows_per_band;
+        int last_row = band_end - BLOCK_SIZE; // exclusive bound on block rows
+        int first = band_start > first_row ? band_start : first_row;
+        int end = last_row < end_row ? last_row : end_row;
+
+        for (int y = first; y < end; y += TILE_ROWS) {
+            for (int s = 0; s < an->strips; s += TILE_STRIPS) {
+                tile_t *tile = &an->tiles[an->tile_count++];
+                tile->first_row = y;
+                tile->end_row = y + TILE_ROWS < end ? y + TILE_ROWS : end;
+                tile->first_strip = s;
+                tile->end_strip = s + TILE_STRIPS < an->strips ? s + TILE_STRIPS : an->strips;
+            }
+        }
+    }
+}
+
+// analyse tiles a row of tiles at a time from the top, stopping once the
+// finished mask rows hold min_pixels. a pixel row only depends on block rows
+// at or above it, so every row before the stop is final
+static void analyze_until(analysis_t *an, size_t min_pixels) {
+    size_t found = 0;
+    int done_rows = 0;
+    int t = 0;
+
+    while (t < an->tile_count && found < min_pixels) {
+        int next = t;
+        while (next < an->tile_count && an->tiles[next].first_row == an->tiles[t].first_row) {
+            next++;
+        }
+        an->tile_first = t;
+        thread_pool_run(analyze_region, an, next - t);
+        if (atomic_load(&an->failed)) {
+            return;
+        }
+
+        // block rows between this tile row and the next are never tested
+        int final_rows = next < an->tile_count ? an->tiles[next].first_row : an->height;
+        dilate_range(an, done_rows, final_rows);
+        found += steg_mask_count_rows(an->mask, done_rows, final_rows);
+        done_rows = final_rows;
+        t = next;
+    }
+}
+
+// the gray copy and median the options bring, or fresh ones
+static uint8_t *gray_for(uint8_t *image, int width, int height, int channels,
+                         const analysis_options_t *options, int *median_out) {
+    if (options->gray) {
+        *median_out = options->global_median;
+        return (uint8_t *)options->gray;
+    }
+    return grayscale_with_median(image, width, height, channels, options->depth,
+                                 options->invariant_planes, median_out);
+}
+
+// gray_for's result is the caller's when the options brought it
+static void gray_release(uint8_t *gray, const analysis_options_t *options) {
+    if (gray != options->gray) {
+        free(gray);
+    }
+}
+
+// shared driver for the fast and reference paths
+static steg_mask_t *analyze_image(uint8_t *image,
+                                  int width,
+                                  int height,
+                                  int channels,
+                                  bool reference,
+                                  const analysis_options_t *options) {
+    // convert to grayscale and take the global median in the same sweep
+    int global_median;
+    uint8_t *gray = gray_for(image, width, height, channels, options, &global_median);
+    if (!gray) {
+        return NULL; // allocation failed
+    }
+
+    // create mask
+    steg_mask_t *mask = steg_mask_create(width, height);
+    if (!mask) {
+        gray_release(gray, options);
+        return NULL; // allocation failed
+    }
+
+    analysis_t an;
+    memset(&an, 0, sizeof(an));
+    an.gray = gray;
+    an.mask = mask;
+    an.width = width;
+    an.height = height;
+    an.strips = width > BLOCK_SIZE ? (width - 1) / BLOCK_SIZE : 0;
+    an.global_median = global_median;
+    an.reference = reference;
+    atomic_init(&an.failed, false);
+
+    // one accepted flag per block position, and the tiles covering them
+    int tile_cols = (an.strips + TILE_STRIPS - 1) / TILE_STRIPS;
+    an.accepted = (uint8_t *)calloc((size_t)height * (size_t)an.strips + 1, 1);
+    an.tiles = (tile_t *)malloc(((size_t)height / TILE_ROWS + 2 * ANALYSIS_BANDS) *
+                                    (size_t)(tile_cols + 1) * sizeof(tile_t));
+    if (!an.accepted || !an.tiles) {
+        free(an.tiles);
+        free(an.accepted);
+        steg_mask_free(mask);
+        gray_release(gray, options);
+        return NULL; // allocation failed
+    }
+
+    an.tile_count = 0;
+    add_tiles(&an, 0, height);
+
+    if (options->min_pixels > 0) {
+        analyze_until(&an, options->min_pixels);
+    } else {
+        an.tile_first = 0;
+        thread_pool_run(analyze_region, &an, an.tile_count);
+        if (!atomic_load(&an.failed)) {
+            dilate_range(&an, 0, height);
+        }
+    }
+
+    free(an.tiles);
+    free(an.accepted);
+    gray_release(gray, options);
+
+    if (atomic_load(&an.failed)) {
+        steg_mask_free(mask);
+        return NULL; // allocation failed
+    }
+    return mask;
+}
+
+// pool task: the low-contrast test for every non-overlapping block of up
+// to GRID_ROWS block rows, one grid bit per block. tasks own whole grid rows
+static void analyze_grid_rows(void *arg, int index) {
+    analysis_t *an = (analysis_t *)arg;
+    steg_mask_t *grid = an->mask;
+    int first = an->grid_first + index * GRID_ROWS;
+    int end = first + GRID_ROWS < an->grid_end ? first + GRID_ROWS : an->grid_end;
+
+    uint32_t sums[GRID_CHUNK];
+    uint32_t sqs[GRID_CHUNK];
+    uint8_t medians[GRID_CHUNK];
+
+    for (int gy = first; gy < end; gy++) {
+        int y = gy * BLOCK_SIZE;
+        const uint8_t *row = gray_row(an, y);
+
+        for (int gx = 0; gx < grid->width; gx += GRID_CHUNK) {
+            int n = grid->width - gx < GRID_CHUNK ? grid->width - gx : GRID_CHUNK;
+            if (!an->reference || an->depths) {
+                block_sums(row + (size_t)gx * BLOCK_SIZE, an->width, n, sums, sqs);
+            }
+            if (!an->reference) {
+                block_medians(row + (size_t)gx * BLOCK_SIZE, an->width, n, medians);
+            }
+
+            for (int b = 0; b < n; b++) {
+                int x = (gx + b) * BLOCK_SIZE;
+                bool ok;
+                if (an->reference) {
+                    ok = reference_block_ok(an, x, y);
+                } else {
+                    ok = abs(medians[b] - an->global_median) < MEDIAN_DELTA_MAX &&
+                         block_std_ok(an, sums[b], sqs[b], x, y);
+                }
+                if (ok) {
+                    steg_mask_set_run(grid, gy - an->mask_first, gx + b, 1);
+                    if (an->depths) {
+                        an->depths[(size_t)(gy - an->mask_first) * grid->width + gx + b] =
+                            (uint8_t)block_depth(sums[b], sqs[b], an->max_depth);
                     }
                 }
             }
         }
     }
-
-    return NULL;
 }
 
-bool *find_low_contrast_regions(uint8_t *image,
-                                int width,
-                                int height,
-                                int channels) {
-    // convert to grayscale
-    uint8_t *gray = (uint8_t *)malloc((size_t)width * (size_t)height);
+// driver of the block-grid analysis; with a budget, GRID_ROWS block rows
+// per pool thread at a time until enough blocks are set
+static steg_mask_t *analyze_blocks(uint8_t *image,
+                                   int width,
+                                   int height,
+                                   int channels,
+                                   bool reference,
+                                   const analysis_options_t *options,
+                                   int max_depth,
+                                   uint8_t **depths_out) {
+    int global_median;
+    uint8_t *gray = gray_for(image, width, height, channels, options, &global_median);
     if (!gray) {
         return NULL; // allocation failed
     }
-    for (int i = 0; i < width * height; i++) {
-        if (channels == 3) {
-            gray[i] = (uint8_t)((image[i * 3] + image[i * 3 + 1] + image[i * 3 + 2]) / 3);
-        } else {
-            gray[i] = image[i];
+
+    steg_mask_t *grid = steg_mask_create(width / BLOCK_SIZE, height / BLOCK_SIZE);
+    uint8_t *depths = depths_out && grid
+                          ? (uint8_t *)calloc((size_t)grid->width * (size_t)grid->height + 1, 1)
+                          : NULL;
+    if (!grid || (depths_out && !depths)) {
+        steg_mask_free(grid);
+        gray_release(gray, options);
+        return NULL; // allocation failed
+    }
+
+    analysis_t an;
+    memset(&an, 0, sizeof(an));
+    an.gray = gray;
+    an.mask = grid;
+    an.width = width;
+    an.height = height;
+    an.global_median = global_median;
+    an.reference = reference;
+    an.depths = depths;
+    an.max_depth = max_depth;
+    atomic_init(&an.failed, false);
+
+    int step = options->min_pixels > 0 ? GRID_ROWS * thread_pool_size() : grid->height;
+    size_t found = 0;
+    for (int gy = 0; gy < grid->height; gy += step) {
+        if (options->min_pixels > 0 && found >= options->min_pixels) {
+            break;
         }
+        an.grid_first = gy;
+        an.grid_end = gy + step < grid->height ? gy + step : grid->height;
+        thread_pool_run(analyze_grid_rows, &an, (an.grid_end - gy + GRID_ROWS - 1) / GRID_ROWS);
+        found += steg_mask_count_rows(grid, an.grid_first, an.grid_end) * BLOCK_AREA;
+    }
+
+    gray_release(gray, options);
+    if (depths_out) {
+        *depths_out = depths;
     }
+    return grid;
+}
 
-    // calculate global median using histogram (no recursion / huge allocations)
-    float global_median = calculate_global_median(gray, width, height);
+steg_mask_t *find_low_contrast_blocks(uint8_t *image,
+                                      int width,
+                                      int height,
+                                      int channels,
+                                      const analysis_options_t *options) {
+    return analyze_blocks(image, width, height, channels, false, options, 1, NULL);
+}
 
-    // create mask
-    bool *mask = (bool *)calloc((size_t)width * (size_t)height, sizeof(bool));
-    if (!mask) {
-        free(gray);
+steg_mask_t *find_low_contrast_blocks_depths(uint8_t *image,
+                                             int width,
+                                             int height,
+                                             int channels,
+                                             const analysis_options_t *options,
+                                             int max_depth,
+                                             uint8_t **depths_out) {
+    return analyze_blocks(image, width, height, channels, false, options, max_depth, depths_out);
+}
+
+steg_mask_t *find_low_contrast_blocks_reference(uint8_t *image,
+                                                int width,
+                                                int height,
+                                                int channels,
+                                                const analysis_options_t *options) {
+    return analyze_blocks(image, width, height, channels, true, options, 1, NULL);
+}
+
+steg_mask_t *find_low_contrast_regions(uint8_t *image,
+                                       int width,
+                                       int height,
+                                       int channels) {
+    analysis_options_t options = {0};
+    return analyze_image(image, width, height, channels, false, &options);
+}
+
+steg_mask_t *find_low_contrast_regions_with(uint8_t *image,
+                                            int width,
+                                            int height,
+                                            int channels,
+                                            const analysis_options_t *options) {
+    return analyze_image(image, width, height, channels, false, options);
+}
+
+steg_mask_t *find_low_contrast_regions_reference(uint8_t *image,
+                                                 int width,
+                                                 int height,
+                                                 int channels,
+                                                 const analysis_options_t *options) {
+    return analyze_image(image, width, height, channels, true, options);
+}
+
+struct stream_analysis {
+    analysis_t an;
+    int channels;
+    int depth;
+    int invariant_planes;
+    bool blocks;
+    int band_rows; // most pixel rows one push may bring
+    int rows_in;   // pixel rows pushed so far
+    int rows_done; // pixel rows whose mask is final
+};
+
+stream_analysis_t *stream_analysis_create(int width,
+                                          int height,
+                                          int channels,
+                                          int depth,
+                                          int global_median,
+                                          int invariant_planes,
+                                          bool blocks,
+                                          int max_depth,
+                                          int band_rows) {
+    stream_analysis_t *sa = (stream_analysis_t *)calloc(1, sizeof(stream_analysis_t));
+    if (!sa) {
         return NULL; // allocation failed
     }
+    sa->channels = channels;
+    sa->depth = depth;
+    sa->invariant_planes = invariant_planes;
+    sa->blocks = blocks;
+    sa->band_rows = band_rows;
 
-    // create threads
-    pthread_t threads[NUM_THREADS];
-    thread_data_t thread_data[NUM_THREADS];
+    analysis_t *an = &sa->an;
+    an->width = width;
+    an->height = height;
+    an->strips = width > BLOCK_SIZE ? (width - 1) / BLOCK_SIZE : 0;
+    an->global_median = global_median;
+    an->max_depth = max_depth;
+    atomic_init(&an->failed, false);
 
-    int rows_per_thread = height / NUM_THREADS;
+    // windows: the rows a push brings plus what earlier rows left pending.
+    // gray keeps up to BLOCK_SIZE - 1 rows for the blocks still to test, the
+    // accepted flags BLOCK_SIZE - 1 block rows above the rows to dilate
+    int tile_cols = (an->strips + TILE_STRIPS - 1) / TILE_STRIPS;
+    an->gray = (uint8_t *)malloc((size_t)(band_rows + BLOCK_SIZE) * (size_t)width);
+    if (blocks) {
+        an->mask = steg_mask_create(width / BLOCK_SIZE, band_rows / BLOCK_SIZE + 1);
+        if (an->mask && max_depth > 1) {
+            an->depths = (uint8_t *)malloc((size_t)an->mask->width * (size_t)an->mask->height + 1);
+        }
+    } else {
+        an->mask = steg_mask_create(width, band_rows + BLOCK_SIZE);
+        an->accepted = (uint8_t *)calloc((size_t)(band_rows + 2 * BLOCK_SIZE) * (size_t)an->strips + 1, 1);
+        an->tiles = (tile_t *)malloc(((size_t)band_rows / TILE_ROWS + 2 * ANALYSIS_BANDS) *
+                                         (size_t)(tile_cols + 1) * sizeof(tile_t));
+    }
+    if (!an->gray || !an->mask || (!blocks && (!an->accepted || !an->tiles)) ||
+        (blocks && max_depth > 1 && !an->depths)) {
+        stream_analysis_free(sa);
+        return NULL; // allocation failed
+    }
+    return sa;
+}
+
+void stream_analysis_free(stream_analysis_t *sa) {
+    if (!sa) {
+        return;
+    }
+    free((uint8_t *)sa->an.gray);
+    free(sa->an.accepted);
+    free(sa->an.tiles);
+    free(sa->an.depths);
+    steg_mask_free(sa->an.mask);
+    free(sa);
+}
+
+// clear the first `rows` rows of the band mask and make them its height
+static void reset_band_mask(steg_mask_t *mask, int rows) {
+    mask->height = rows;
+    memset(mask->bits, 0, mask->stride * (size_t)rows * sizeof(uint64_t));
+}
+
+int stream_analysis_push(stream_analysis_t *sa, const uint8_t *pixels, int rows) {
+    analysis_t *an = &sa->an;
+    uint8_t *gray = (uint8_t *)an->gray;
+    int rows_in = sa->rows_in + rows;
 
-    for (int i = 0; i < NUM_THREADS; i++) {
-        thread_data[i].image = image;
-        thread_data[i].gray = gray;
-        thread_data[i].mask = mask;
-        thread_data[i].width = width;
-        thread_data[i].height = height;
-        thread_data[i].channels = channels;
-        thread_data[i].start_row = i * rows_per_thread;
-        thread_data[i].end_row = (i == NUM_THREADS - 1)
-                                     ? height
-                                     : (i + 1) * rows_per_thread;
-        thread_data[i].global_median = global_median;
+    // slide the gray window down to the first row still needed, then
+    // convert the new rows below it
+    int kept = sa->rows_in - sa->rows_done;
+    memmove(gray, gray_row(an, sa->rows_done), (size_t)kept * (size_t)an->width);
+    an->gray_first = sa->rows_done;
+    if (!grayscale_rows(pixels, an->width, rows, sa->channels, sa->depth, sa->invariant_planes,
+                        gray + (size_t)kept * an->width, NULL)) {
+        return -1; // allocation failed
+    }
 
-        pthread_create(&threads[i], NULL, analyze_region, &thread_data[i]);
+    if (sa->blocks) {
+        // every block row that is complete now
+        int grid_first = sa->rows_done / BLOCK_SIZE;
+        int grid_end = rows_in / BLOCK_SIZE;
+        reset_band_mask(an->mask, grid_end - grid_first);
+        an->mask_first = grid_first;
+        an->grid_first = grid_first;
+        an->grid_end = grid_end;
+        thread_pool_run(analyze_grid_rows, an, (grid_end - grid_first + GRID_ROWS - 1) / GRID_ROWS);
+        sa->rows_done = rows_in == an->height ? an->height : grid_end * BLOCK_SIZE;
+        sa->rows_in = rows_in;
+        return sa->rows_done;
     }
 
-    // wait for all threads
-    for (int i = 0; i < NUM_THREADS; i++) {
-        pthread_join(threads[i], NULL);
+    // block rows whose BLOCK_SIZE rows are all in; the pixel rows above the
+    // first untested one are covered by tested blocks only, so they are final
+    int end = rows_in == an->height ? an->height : rows_in - BLOCK_SIZE + 1;
+    if (end < sa->rows_done) {
+        end = sa->rows_done;
     }
 
-    free(gray);
+    int accepted_first = sa->rows_done > BLOCK_SIZE - 1 ? sa->rows_done - (BLOCK_SIZE - 1) : 0;
+    size_t kept_flags = (size_t)(sa->rows_done - accepted_first) * an->strips;
+    memmove(an->accepted, accepted_row(an, accepted_first), kept_flags);
+    memset(an->accepted + kept_flags, 0, (size_t)(end - sa->rows_done) * an->strips);
+    an->accepted_first = accepted_first;
 
-    return mask;
+    an->tile_count = 0;
+    add_tiles(an, sa->rows_done, end);
+    an->tile_first = 0;
+    thread_pool_run(analyze_region, an, an->tile_count);
+    if (atomic_load(&an->failed)) {
+        return -1; // allocation failed
+    }
+
+    reset_band_mask(an->mask, end - sa->rows_done);
+    an->mask_first = sa->rows_done;
+    dilate_range(an, sa->rows_done, end);
+
+    sa->rows_done = end;
+    sa->rows_in = rows_in;
+    return end;
 }
 
+const steg_mask_t *stream_analysis_mask(const stream_analysis_t *sa) {
+    return sa->an.mask;
+}
 
+const uint8_t *stream_analysis_depths(const stream_analysis_t *sa) {
+    return sa->an.depths;
+}
@@ -3,15 +3,158 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+#include "block_stats.h"
+#include "mask.h"
 
 // find low contrast regions in image
 // image: width * height * channels (RGB or grayscale)
-// returns mask (width * height, true = can embed here), caller must free
-bool *find_low_contrast_regions(uint8_t *image,
-                                int width,
-                                int height,
-                                int channels);
+// returns mask (one bit per pixel, set = can embed here),
+// caller must free with steg_mask_free
+steg_mask_t *find_low_contrast_regions(uint8_t *image,
+                                       int width,
+                                       int height,
+                                       int channels);
 
-#endif
+// analysis variants; all zero gives the find_low_contrast_regions mask
+typedef struct {
+    // low bit planes of every sample left out of the statistics. with 1 the
+    // mask only depends on the upper 7 bits, so LSB embedding cannot change
+    // it and the decoder recomputes exactly the encoder's mask
+    int invariant_planes;
+
+    // when > 0, rows are analysed from the top, a tile row (256 block rows)
+    // at a time, until at least min_pixels mask pixels are set. rows up to
+    // there match the full mask exactly and the rest are left clear, so the
+    // first min_pixels pixels in raster order (and an embedding plan's first
+    // min_pixels * channels bits) are the same as the full mask's. the gray
+    // conversion and global median still cover the whole image
+    size_t min_pixels;
+
+    // when not NULL, the image's gray copy made beforehand with the same
+    // invariant_planes (grayscale_rows over every row, as a pipelined loader
+    // does while decoding) and global_median its median; the analysis then
+    // skips its own conversion pass and leaves gray to the caller
+    const uint8_t *gray;
+    int global_median;
+
+    // bits per sample: 8 (0 means 8 too), or 16 for native-endian uint16_t
+    // samples, analysed by their high byte
+    int depth;
+} analysis_options_t;
+
+steg_mask_t *find_low_contrast_regions_with(uint8_t *image,
+                                            int width,
+                                            int height,
+                                            int channels,
+                                            const analysis_options_t *options);
+
+// same mask as find_low_contrast_regions_with, computed the original way
+// (float copy, bubble-sort median and float std per block); much slower,
+// kept so the fast path can be checked against it
+steg_mask_t *find_low_contrast_regions_reference(uint8_t *image,
+                                                 int width,
+                                                 int height,
+                                                 int channels,
+                                                 const analysis_options_t *options);
+
+// block-grid mask: one decision per non-overlapping BLOCK_SIZE x BLOCK_SIZE
+// block (complete blocks only), bit (bx, by) set when the block at pixel
+// (bx * BLOCK_SIZE, by * BLOCK_SIZE) passes the low-contrast test. the grid
+// is (width / BLOCK_SIZE) x (height / BLOCK_SIZE), BLOCK_AREA times smaller
+// than a pixel mask. with min_pixels set, block rows are analysed from the
+// top until the set blocks cover that many pixels; later rows stay clear
+steg_mask_t *find_low_contrast_blocks(uint8_t *image,
+                                      int width,
+                                      int height,
+                                      int channels,
+                                      const analysis_options_t *options);
+
+// find_low_contrast_blocks with a k-LSB depth for every set block: 1 up to
+// max_depth bit planes per sample, more the higher the block's std (busy
+// blocks hide more). *depths_out gets one byte per grid cell, row-major, 0
+// for clear blocks; caller frees. the depths come from the same integer
+// statistics as the test, so with invariant_planes >= max_depth embedding
+// leaves them as they were. NULL if allocation failed
+steg_mask_t *find_low_contrast_blocks_depths(uint8_t *image,
+                                             int width,
+                                             int height,
+                                             int channels,
+                                             const analysis_options_t *options,
+                                             int max_depth,
+                                             uint8_t **depths_out);
+
+// find_low_contrast_blocks with the float reference statistics
+steg_mask_t *find_low_contrast_blocks_reference(uint8_t *image,
+                                                int width,
+                                                int height,
+                                                int channels,
+                                                const analysis_options_t *options);
 
+// gray copy of the image ((r + g + b) / 3 of the first three samples with
+// 3 or 4 channels, the first sample with 1 or 2, low invariant_planes bits
+// of every sample cleared; 16-bit samples count by their high byte) and its
+// median gray value, in one pass on the thread pool; caller frees the
+// result, NULL if allocation failed
+uint8_t *grayscale_with_median(const uint8_t *image,
+                               int width,
+                               int height,
+                               int channels,
+                               int depth,
+                               int invariant_planes,
+                               int *median_out);
 
+// the same gray conversion for `rows` rows of pixels into gray, adding each
+// value's count to hist[256] unless hist is NULL; false if allocation failed
+bool grayscale_rows(const uint8_t *pixels,
+                    int width,
+                    int rows,
+                    int channels,
+                    int depth,
+                    int invariant_planes,
+                    uint8_t *gray,
+                    uint64_t *hist);
+
+// streaming analysis, for images too large to hold: pixel rows go in a band
+// at a time, top to bottom, and every push finishes the mask rows it can.
+// memory is a few bands whatever the image size. the global median comes
+// from a first pass over the image (grayscale_rows + gray_histogram_median)
+typedef struct stream_analysis stream_analysis_t;
+
+// analysis of a width x height image with the given median, giving the
+// find_low_contrast_regions_with mask or, with blocks, the
+// find_low_contrast_blocks grid (with find_low_contrast_blocks_depths
+// depths when max_depth > 1); pushes bring at most band_rows rows. NULL if
+// allocation failed
+stream_analysis_t *stream_analysis_create(int width,
+                                          int height,
+                                          int channels,
+                                          int depth,
+                                          int global_median,
+                                          int invariant_planes,
+                                          bool blocks,
+                                          int max_depth,
+                                          int band_rows);
+
+void stream_analysis_free(stream_analysis_t *sa);
+
+// analyse the next `rows` rows of pixels; returns how many image rows from
+// the top have a final mask now (all of them after the last push), -1 if
+// allocation failed
+int stream_analysis_push(stream_analysis_t *sa, const uint8_t *pixels, int rows);
+
+// mask rows finished by the last push: the pixel rows between the previous
+// and the new stream_analysis_push result, or for a grid the block rows
+// inside them
+const steg_mask_t *stream_analysis_mask(const stream_analysis_t *sa);
+
+// depths of the grid rows stream_analysis_mask holds, laid out the same
+// way; NULL without them
+const uint8_t *stream_analysis_depths(const stream_analysis_t *sa);
+
+// global median of a gray histogram of `total` values: the first value the
+// running count reaches total / 2 at
+int gray_histogram_median(const uint64_t *hist, uint64_t total);
+
+#endif
@@ -1,81 +1,143 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
+#include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
 
+#include "cpu_dispatch.h"
 #include "encryption.h"
 #include "image_analysis.h"
 #include "embedding.h"
+#include "png_stream.h"
+#include "png_write.h"
+#include "probe.h"
+#include "thread_pool.h"
 
 #define ENCRYPTED_FOLDER "../encrypted"
 #define IMAGE_FOLDER "../image"
 
+// PNGs that decode to at least this many bytes are streamed a band at a
+// time instead of loaded whole
+#define STREAM_MIN_BYTES ((size_t)256 << 20)
+
+// output PNG settings: defaults, then STEG_PNG_*, then the command line
+static png_write_options_t png_options;
+
+// most bit planes per sample to embed in (k-LSB): STEG_LSB_BITS, then the
+// command line. above 1 the block grid is used with a depth per block
+static int lsb_bits = 1;
+
+// matrix coding parameter p, 3 bits in 7 slots for p = 3; 0 (or 1) embeds
+// plain LSB. STEG_MATRIX, then the command line
+static int matrix_coding = 0;
+
+// numeric options: command line flag, environment variable, range and the
+// setting they change
 typedef struct {
-    uint8_t *encrypted;
-    size_t enc_len;
-    bool *mask;
-    int ready_flags;
-    pthread_mutex_t mutex;
-} shared_data_t;
-
-// encryption thread worker
-static void *encrypt_worker(void *arg) {
-    void **params = (void **)arg;
-    const char *message = (const char *)params[0];
-    const char *key = (const char *)params[1];
-    shared_data_t *shared = (shared_data_t *)params[2];
-
-    shared->enc_len = encrypt_message(message, key, &shared->encrypted);
-    if (shared->enc_len == 0 || !shared->encrypted) {
-        printf("❌ encryption failed (memory allocation error)\n");
-        pthread_mutex_lock(&shared->mutex);
-        shared->ready_flags |= 1;
-        pthread_mutex_unlock(&shared->mutex);
-        return NULL;
-    }
-
-    pthread_mutex_lock(&shared->mutex);
-    shared->ready_flags |= 1;
-    pthread_mutex_unlock(&shared->mutex);
-
-    printf("✓ encryption complete (%zu bytes)\n", shared->enc_len);
-    return NULL;
+    const char *flag;
+    const char *env;
+    int min;
+    int max;
+    int *value;
+} int_option_t;
+
+static const int_option_t int_options[] = {
+    {"--lsb-bits", "STEG_LSB_BITS", 1, EMBED_DEPTH_MAX, &lsb_bits},
+    {"--matrix", "STEG_MATRIX", 0, EMBED_MATRIX_MAX, &matrix_coding},
+};
+
+// a decoded image: `channels` interleaved samples of `depth` bits (16-bit
+// ones as native-endian uint16_t). PNGs come through the pipelined loader,
+// which also leaves the LSB-invariant gray copy and its median; gray is NULL
+// for other files
+typedef struct {
+    uint8_t *pixels;
+    int width;
+    int height;
+    int channels;
+    int depth;
+    uint8_t *gray;
+    int median;
+} loaded_image_t;
+
+// the image in its own channels and depth; false if it could not be read
+static bool load_image(const char *path, loaded_image_t *img) {
+    memset(img, 0, sizeof(*img));
+    if (png_stream_probe(path, &img->width, &img->height)) {
+        img->pixels = png_stream_load(path, &img->width, &img->height, &img->channels,
+                                      &img->depth, MASK_INVARIANT_PLANES, &img->gray,
+                                      &img->median);
+    } else if (stbi_is_16_bit(path)) {
+        img->pixels = (uint8_t *)stbi_load_16(path, &img->width, &img->height, &img->channels, 0);
+        img->depth = 16;
+    } else {
+        img->pixels = stbi_load(path, &img->width, &img->height, &img->channels, 0);
+        img->depth = 8;
+    }
+    return img->pixels != NULL;
 }
 
-// image analysis thread worker
-static void *analysis_worker(void *arg) {
-    void **params = (void **)arg;
-    uint8_t *image = (uint8_t *)params[0];
-    int width = *(int *)params[1];
-    int height = *(int *)params[2];
-    int channels = *(int *)params[3];
-    shared_data_t *shared = (shared_data_t *)params[4];
-
-    shared->mask = find_low_contrast_regions(image, width, height, channels);
-    if (!shared->mask) {
-        printf("❌ image analysis failed (memory allocation error)\n");
-        pthread_mutex_lock(&shared->mutex);
-        shared->ready_flags |= 2;
-        pthread_mutex_unlock(&shared->mutex);
-        return NULL;
-    }
+static void free_image(loaded_image_t *img) {
+    free(img->pixels);
+    free(img->gray);
+}
+
+static probe_image_t image_view(const loaded_image_t *img) {
+    probe_image_t view = {img->pixels, img->width, img->height, img->channels, img->depth,
+                          img->gray, img->median};
+    return view;
+}
 
-    pthread_mutex_lock(&shared->mutex);
-    shared->ready_flags |= 2;
-    pthread_mutex_unlock(&shared->mutex);
+// mask of an EMBED_FORMAT_* turned into its embedding plan, from the
+// loader's gray copy when it has one for this format; NULL if allocation
+// failed
+static embed_plan_t *plan_for_format(const loaded_image_t *img, uint32_t format,
+                                     size_t min_pixels) {
+    probe_image_t view = image_view(img);
+    return probe_format_plan(&view, format, min_pixels);
+}
+
+// inputs and results of the two encode stages
+typedef struct {
+    const char *message;
+    const char *key;
+    const loaded_image_t *img;
+    size_t min_pixels;
+    uint32_t format;
+    uint8_t *encrypted; // stage 0: the ciphertext
+    size_t enc_len;
+    embed_plan_t *plan; // stage 1: where it goes
+} encode_job_t;
+
+// pool task running encryption (0) and image analysis (1) side by side;
+// each stage only writes its own results
+static void encode_stage(void *arg, int index) {
+    encode_job_t *job = (encode_job_t *)arg;
+    if (index == 0) {
+        job->enc_len = encrypt_message(job->message, job->key, &job->encrypted);
+        if (job->enc_len == 0 || !job->encrypted) {
+            printf("❌ encryption failed (memory allocation error)\n");
+            return;
+        }
+        printf("✓ encryption complete (%zu bytes)\n", job->enc_len);
+        return;
+    }
 
+    // only as much of the image as the payload needs, with a mask the
+    // decoder can reproduce exactly
+    job->plan = plan_for_format(job->img, job->format, job->min_pixels);
+    if (!job->plan) {
+        printf("❌ image analysis failed (memory allocation error)\n");
+        return;
+    }
     printf("✓ image analysis complete\n");
-    return NULL;
 }
 
 // create encrypted folder if it doesn't exist
@@ -95,6 +157,58 @@ static const char *get_filename(const char *path) {
     return path;
 }
 
+// whether to take the streaming path for this file: STEG_STREAM=1 streams
+// every PNG it can, STEG_STREAM=0 none, otherwise large PNGs only
+static bool use_stream(const char *path) {
+    const char *env = getenv("STEG_STREAM");
+    if (env && strcmp(env, "0") == 0) {
+        return false;
+    }
+    int width, height;
+    if (!png_stream_probe(path, &width, &height)) {
+        return false; // not a PNG, or an interlaced one
+    }
+    return (env && strcmp(env, "1") == 0) ||
+           (size_t)width * (size_t)height * 3 >= STREAM_MIN_BYTES;
+}
+
+// mask settings of an EMBED_FORMAT_* for the streaming path
+static stream_format_t stream_format_for(uint32_t format, bool legacy) {
+    stream_format_t settings = {format, probe_invariant_planes(format), probe_is_blocks(format),
+                                legacy, -1};
+    return settings;
+}
+
+// streaming encode: the message is encrypted first, then the image goes
+// through in bands and is never held whole
+static int encode_stream(const char *input_path,
+                         const char *message,
+                         const char *key,
+                         const char *output_path,
+                         uint32_t format) {
+    int width, height;
+    png_stream_probe(input_path, &width, &height);
+    printf("streaming image: %dx%d in %d-row bands\n", width, height, STREAM_BAND_ROWS);
+
+    uint8_t *encrypted = NULL;
+    size_t enc_len = encrypt_message(message, key, &encrypted);
+    if (enc_len == 0 || !encrypted) {
+        printf("❌ encryption failed\n");
+        free(encrypted);
+        return 0;
+    }
+    printf("✓ encryption complete (%zu bytes)\n", enc_len);
+
+    stream_format_t settings = stream_format_for(format, false);
+    int ok = png_stream_embed(input_path, output_path, encrypted, enc_len, &settings,
+                              &png_options);
+    if (ok) {
+        printf("✓ message hidden in %s\n", output_path);
+    }
+    free(encrypted);
+    return ok;
+}
+
 // encoding function
 static int encode_image(const char *input_path,
                         const char *message,
@@ -102,127 +216,163 @@ static int encode_image(const char *input_path,
                         const char *output_path) {
     printf("\n=== ENCODING ===\n");
 
-    int width, height, channels;
-    uint8_t *image = stbi_load(input_path, &width, &height, &channels, 3);
-    if (!image) {
+    // STEG_MASK=blocks picks the block-grid mask, more than one LSB its
+    // k-LSB variant
+    const char *mask_mode = getenv("STEG_MASK");
+    uint32_t format = mask_mode && strcmp(mask_mode, "blocks") == 0 ? EMBED_FORMAT_BLOCKS
+                                                                     : EMBED_FORMAT_PIXELS;
+    if (lsb_bits > 1) {
+        format = EMBED_FORMAT_DEEP(lsb_bits);
+        printf("k-LSB: up to %d bits per sample, chosen per block\n", lsb_bits);
+    }
+    if (matrix_coding >= EMBED_MATRIX_MIN) {
+        printf("matrix coding: %d bits in %d slots\n", matrix_coding, (1 << matrix_coding) - 1);
+    }
+    if (use_stream(input_path)) {
+        if (matrix_coding >= EMBED_MATRIX_MIN) {
+            // a group can span two bands, and the earlier one's rows are
+            // already written by the time the later one is read
+            printf("ℹ️  streaming writes plain LSB, matrix coding ignored\n");
+        }
+        return encode_stream(input_path, message, key, output_path, format);
+    }
+
+    loaded_image_t img;
+    if (!load_image(input_path, &img)) {
         printf("❌ failed to load image: %s\n", input_path);
         printf("   make sure the file exists and is a valid PNG/JPG\n");
         return 0;
     }
-    channels = 3;
 
-    printf("loaded image: %dx%d with %d channels\n", width, height, channels);
+    printf("loaded image: %dx%d with %d channels, %d-bit\n", img.width, img.height,
+           img.channels, img.depth);
 
-    shared_data_t shared = {0};
-    pthread_mutex_init(&shared.mutex, NULL);
+    // the ciphertext is as long as the message, so the bit budget is known
+    // before encryption finishes
+    embed_layout_t layout = embed_layout_for(img.channels, img.depth);
+    size_t pixel_bits = (size_t)layout.color_channels * (size_t)layout.planes;
+    size_t min_bits = embed_header_size(strlen(message)) * 8 +
+                      embed_coded_slots(strlen(message), matrix_coding);
+    size_t min_pixels = (min_bits + pixel_bits - 1) / pixel_bits;
+    encode_job_t job = {message, key, &img, min_pixels, format, NULL, 0, NULL};
+    thread_pool_run(encode_stage, &job, 2);
 
-    void *encrypt_params[3] = {(void *)message, (void *)key, &shared};
-    void *analysis_params[5] = {image, &width, &height, &channels, &shared};
-
-    pthread_t encrypt_thread, analysis_thread;
-    pthread_create(&encrypt_thread, NULL, encrypt_worker, encrypt_params);
-    pthread_create(&analysis_thread, NULL, analysis_worker, analysis_params);
-
-    pthread_join(encrypt_thread, NULL);
-    pthread_join(analysis_thread, NULL);
-
-    printf("✓ both threads completed\n");
+    printf("✓ both stages completed\n");
 
     // verify both operations succeeded
-    if (!shared.encrypted || shared.enc_len == 0) {
+    if (!job.encrypted || job.enc_len == 0) {
         printf("❌ encryption failed\n");
-        if (shared.mask) free(shared.mask);
-        stbi_image_free(image);
-        pthread_mutex_destroy(&shared.mutex);
+        embed_plan_free(job.plan);
+        free_image(&img);
         return 0;
     }
-    if (!shared.mask) {
+    if (!job.plan) {
         printf("❌ image analysis failed\n");
-        free(shared.encrypted);
-        stbi_image_free(image);
-        pthread_mutex_destroy(&shared.mutex);
+        free(job.encrypted);
+        free_image(&img);
         return 0;
     }
 
-    int mask_pixels = 0;
-    for (int i = 0; i < width * height; i++) {
-        if (shared.mask[i]) {
-            mask_pixels++;
-        }
-    }
-
-    size_t total_size = 4 + shared.enc_len;
-    int bits_needed = (int)(total_size * 8);
-    int bits_available = mask_pixels * 3;
+    embed_plan_t *plan = job.plan;
+    size_t bits_needed = embed_header_size(job.enc_len) * 8 +
+                         embed_coded_slots(job.enc_len, matrix_coding);
+    size_t bits_available = plan->capacity;
 
-    printf("embedding capacity: %d bits available, %d bits needed\n",
+    printf("embedding capacity: %zu bits available, %zu bits needed\n",
            bits_available, bits_needed);
 
     if (bits_available < bits_needed) {
         printf("❌ not enough low-contrast regions! need larger image\n");
-        free(shared.encrypted);
-        free(shared.mask);
-        stbi_image_free(image);
-        pthread_mutex_destroy(&shared.mutex);
+        embed_plan_free(plan);
+        free(job.encrypted);
+        free_image(&img);
         return 0;
     }
 
-    embed_message(image, width, height, channels,
-                  shared.encrypted, shared.enc_len, shared.mask);
+    embed_message(img.pixels, plan, job.encrypted, job.enc_len, format,
+                  matrix_coding);
+    embed_plan_free(plan);
 
-    if (!stbi_write_png(output_path, width, height, channels,
-                        image, width * channels)) {
+    if (!png_write_file(output_path, img.width, img.height, img.channels, img.depth, img.pixels,
+                        &png_options)) {
         printf("❌ failed to write output image\n");
-        free(shared.encrypted);
-        free(shared.mask);
-        stbi_image_free(image);
-        pthread_mutex_destroy(&shared.mutex);
+        free(job.encrypted);
+        free_image(&img);
         return 0;
     }
 
     printf("✓ message hidden in %s\n", output_path);
 
-    free(shared.encrypted);
-    free(shared.mask);
-    stbi_image_free(image);
-    pthread_mutex_destroy(&shared.mutex);
+    free(job.encrypted);
+    free_image(&img);
 
     return 1;
 }
 
+// recompute the mask of a format and extract from it, taking a legacy
+// header too if `legacy` is set; returns the encrypted length, 0 if no
+// message of that format was found
+static size_t extract_format(const loaded_image_t *img, uint32_t format, bool legacy,
+                             uint8_t **encrypted_out) {
+    embed_plan_t *plan = plan_for_format(img, format, 0);
+    if (!plan) {
+        printf("❌ failed to analyze image (memory allocation error)\n");
+        return 0;
+    }
+    printf("✓ mask computed\n");
+
+    size_t enc_len = extract_message(img->pixels, plan, format, legacy, encrypted_out);
+    embed_plan_free(plan);
+    return enc_len;
+}
+
 // decoding function (recomputes mask from stego image)
 static void decode_image(const char *input_path, const char *key) {
     printf("\n=== DECODING ===\n");
 
-    int width, height, channels;
-    uint8_t *image = stbi_load(input_path, &width, &height, &channels, 3);
-    if (!image) {
-        printf("❌ failed to load image: %s\n", input_path);
-        printf("   make sure the file exists and is a valid PNG/JPG\n");
-        return;
-    }
-    channels = 3;
-
-    printf("loaded stego image: %dx%d\n", width, height);
+    // recompute the mask from the stego image, trying each format in turn:
+    // the LSB-invariant masks come out exactly as the encoder's, images
+    // written before them used the full-byte mask. a legacy header has no
+    // magic or CRC, so it is only read through that mask, once no format
+    // has a versioned header
+    uint8_t *encrypted = NULL;
+    size_t enc_len = 0;
+    loaded_image_t img = {0};
+
+    if (use_stream(input_path)) {
+        printf("streaming stego image in %d-row bands...\n", STREAM_BAND_ROWS);
+        // as in memory, the message is only extracted once a probe found it
+        probe_result_t found;
+        if (probe_png_stream(input_path, true, &found)) {
+            printf("✓ %s header found\n", probe_format_name(found.format));
+            stream_format_t settings = stream_format_for(found.format,
+                                                         found.header.version == 0);
+            settings.median = found.median;
+            enc_len = png_stream_extract(input_path, &settings, &encrypted);
+        }
+    } else {
+        if (!load_image(input_path, &img)) {
+            printf("❌ failed to load image: %s\n", input_path);
+            printf("   make sure the file exists and is a valid PNG/JPG\n");
+            return;
+        }
 
-    // recompute mask from stego image (LSB changes don't affect low-contrast detection much)
-    printf("analyzing image to find embedding regions...\n");
-    bool *mask = find_low_contrast_regions(image, width, height, channels);
-    if (!mask) {
-        printf("❌ failed to analyze image (memory allocation error)\n");
-        stbi_image_free(image);
-        return;
+        printf("loaded stego image: %dx%d with %d channels, %d-bit\n", img.width, img.height,
+               img.channels, img.depth);
+        printf("analyzing image to find embedding regions...\n");
+        // the probe finds the format from the top of each mask; only that
+        // one is then computed whole
+        probe_image_t view = image_view(&img);
+        probe_result_t found;
+        if (probe_image(&view, true, &found)) {
+            printf("✓ %s header found\n", probe_format_name(found.format));
+            enc_len = extract_format(&img, found.format, found.header.version == 0, &encrypted);
+        }
     }
-    printf("✓ mask computed\n");
-
-    uint8_t *encrypted = NULL;
-    size_t enc_len = extract_message(image, width, height, channels,
-                                     mask, &encrypted);
 
     if (enc_len == 0) {
         printf("❌ failed to extract message (image may not contain hidden data)\n");
-        free(mask);
-        stbi_image_free(image);
+        free_image(&img);
         return;
     }
 
@@ -232,8 +382,7 @@ static void decode_image(const char *input_path, const char *key) {
     if (!message) {
         printf("❌ decryption failed (memory allocation error)\n");
         free(encrypted);
-        free(mask);
-        stbi_image_free(image);
+        free_image(&img);
         return;
     }
 
@@ -242,8 +391,7 @@ static void decode_image(const char *input_path, const char *key) {
 
     free(encrypted);
     free(message);
-    free(mask);
-    stbi_image_free(image);
+    free_image(&img);
 }
 
 // read a line from stdin (handles spaces)
@@ -387,10 +535,208 @@ static char *read_message(void) {
     return message;
 }
 
-int main(void) {
+// probe subcommand totals
+typedef struct {
+    int images;
+    int found;
+    int unreadable;
+} probe_stats_t;
+
+// probe one image and print what it holds
+static void probe_file(const char *path, probe_stats_t *stats) {
+    probe_result_t found;
+    bool has_message = false;
+    stats->images++;
+
+    if (use_stream(path)) {
+        has_message = probe_png_stream(path, true, &found);
+    } else {
+        loaded_image_t img;
+        if (!load_image(path, &img)) {
+            printf("❌ %s: cannot read image\n", path);
+            stats->unreadable++;
+            return;
+        }
+        probe_image_t view = image_view(&img);
+        has_message = probe_image(&view, true, &found);
+        free_image(&img);
+    }
+
+    if (!has_message) {
+        printf("   %s: no message\n", path);
+        return;
+    }
+    stats->found++;
+    char coding[16] = "plain";
+    if (found.header.matrix) {
+        snprintf(coding, sizeof(coding), "matrix %d", found.header.matrix);
+    }
+    printf("✓ %s: %s mask, %zu bytes, %s%s\n", path, probe_format_name(found.format),
+           found.header.length, coding, found.header.version ? "" : ", 4-byte header");
+}
+
+// probe a file, or every image file below a directory
+static void probe_path(const char *path, probe_stats_t *stats) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        probe_file(path, stats);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        bool is_dir = entry->d_type == DT_DIR;
+        if ((is_dir && entry->d_name[0] == '.') ||
+            (!is_dir && (entry->d_type != DT_REG || !is_image_file(entry->d_name)))) {
+            continue;
+        }
+        size_t len = strlen(path) + strlen(entry->d_name) + 2;
+        char *child = (char *)malloc(len);
+        if (!child) {
+            printf("❌ memory allocation failed\n");
+            break;
+        }
+        snprintf(child, len, "%s/%s", path, entry->d_name);
+        if (is_dir) {
+            probe_path(child, stats);
+        } else {
+            probe_file(child, stats);
+        }
+        free(child);
+    }
+    closedir(dir);
+}
+
+// probe subcommand: report which images under the given paths carry a
+// message, without extracting any; 0 if every image could be read
+static int probe_command(int count, char **paths) {
+    probe_stats_t stats = {0, 0, 0};
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < count; i++) {
+        probe_path(paths[i], &stats);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double seconds = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    printf("\nprobed %d images in %.3f s: %d with a message, %d unreadable\n", stats.images,
+           seconds, stats.found, stats.unreadable);
+    return stats.unreadable ? 1 : 0;
+}
+
+// value as an integer in [min, max] (min >= 0), -1 if it is not one
+static int parse_int(const char *value, int min, int max) {
+    char *end;
+    long v = strtol(value, &end, 10);
+    return *value && !*end && v >= min && v <= max ? (int)v : -1;
+}
+
+// command line: --cpu-tier NAME caps the kernels at portable, avx2 or
+// avx512, like STEG_CPU_TIER; --png-level, --png-filter and --png-strategy
+// tune the output PNG, like STEG_PNG_*; --lsb-bits K embeds up to K bits
+// per sample and --matrix P matrix codes P bits into 2^P - 1 slots, like
+// STEG_LSB_BITS and STEG_MATRIX. each also takes --name=VALUE. returns the
+// index of the first argument after the options (argc if there is none),
+// -1 on bad usage
+static int parse_options(int argc, char **argv) {
+    static const char *png_names[] = {"level", "filter", "strategy"};
+    size_t int_count = sizeof(int_options) / sizeof(int_options[0]);
+    png_write_options_default(&png_options);
+    png_write_options_from_env(&png_options);
+
+    for (size_t k = 0; k < int_count; k++) {
+        const int_option_t *option = &int_options[k];
+        const char *env = getenv(option->env);
+        int v = env && *env ? parse_int(env, option->min, option->max) : -1;
+        if (env && *env && v < 0) {
+            printf("❌ invalid %s '%s', ignored\n", option->env, env);
+        } else if (v >= 0) {
+            *option->value = v;
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            return i;
+        }
+        char name[32];
+        const char *value = NULL;
+        const char *eq = strchr(argv[i], '=');
+        size_t len = eq ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+        if (len < sizeof(name)) {
+            memcpy(name, argv[i], len);
+            name[len] = '\0';
+            if (eq) {
+                value = eq + 1;
+            } else if (i + 1 < argc) {
+                value = argv[++i];
+            }
+        }
+        if (!value) {
+            printf("usage: %s [--cpu-tier portable|avx2|avx512|auto] [--png-level 0-9|store]\n"
+                   "       [--png-filter none|sub|up|avg|paeth|all]\n"
+                   "       [--png-strategy default|filtered|huffman|rle|fixed] [--lsb-bits 1-%d]\n"
+                   "       [--matrix 0-%d] [probe PATH...]\n",
+                   argv[0], EMBED_DEPTH_MAX, EMBED_MATRIX_MAX);
+            return -1;
+        }
+
+        if (strcmp(name, "--cpu-tier") == 0) {
+            int t = cpu_tier_parse(value);
+            if (t < 0) {
+                printf("❌ unknown CPU tier '%s'\n", value);
+                return -1;
+            }
+            cpu_tier_force((cpu_tier_t)t);
+            continue;
+        }
+        bool known = false;
+        for (size_t k = 0; k < int_count; k++) {
+            const int_option_t *option = &int_options[k];
+            if (strcmp(name, option->flag) == 0) {
+                known = true;
+                *option->value = parse_int(value, option->min, option->max);
+                if (*option->value < 0) {
+                    printf("❌ invalid %s '%s' (%d-%d)\n", name, value, option->min, option->max);
+                    return -1;
+                }
+            }
+        }
+        for (size_t k = 0; k < sizeof(png_names) / sizeof(png_names[0]); k++) {
+            if (strncmp(name, "--png-", 6) == 0 && strcmp(name + 6, png_names[k]) == 0) {
+                known = true;
+                if (!png_write_options_set(&png_options, png_names[k], value)) {
+                    printf("❌ invalid %s '%s'\n", name, value);
+                    return -1;
+                }
+            }
+        }
+        if (!known) {
+            printf("❌ unknown option '%s'\n", name);
+            return -1;
+        }
+    }
+    return argc;
+}
+
+int main(int argc, char **argv) {
+    int first = parse_options(argc, argv);
+    if (first < 0) {
+        return 1;
+    }
+    if (first < argc) {
+        if (strcmp(argv[first], "probe") != 0 || first + 1 == argc) {
+            printf("usage: %s [options] probe PATH...\n", argv[0]);
+            return 1;
+        }
+        return probe_command(argc - first - 1, argv + first + 1);
+    }
+
     printf("╔════════════════════════════════════════╗\n");
     printf("║   LSB STEGANOGRAPHY (PNG SUPPORT)     ║\n");
     printf("╚════════════════════════════════════════╝\n\n");
+    printf("ℹ️  kernels: %s (CPU supports %s)\n\n",
+           cpu_tier_name(cpu_tier()), cpu_tier_name(cpu_tier_detected()));
 
     ensure_encrypted_folder();
     
@@ -0,0 +1,54 @@
+#include "mask.h"
+
+#include <stdlib.h>
+
+steg_mask_t *steg_mask_create(int width, int height) {
+    steg_mask_t *mask = (steg_mask_t *)malloc(sizeof(steg_mask_t));
+    if (!mask) {
+        return NULL; // allocation failed
+    }
+    mask->width = width;
+    mask->height = height;
+    mask->stride = ((size_t)width + 63) / 64;
+    mask->bits = (uint64_t *)calloc(mask->stride * (size_t)height + 1, sizeof(uint64_t));
+    if (!mask->bits) {
+        free(mask);
+        return NULL; // allocation failed
+    }
+    return mask;
+}
+
+void steg_mask_free(steg_mask_t *mask) {
+    if (!mask) {
+        return;
+    }
+    free(mask->bits);
+    free(mask);
+}
+
+size_t steg_mask_count(const steg_mask_t *mask) {
+    return steg_mask_count_rows(mask, 0, mask->height);
+}
+
+size_t steg_mask_count_rows(const steg_mask_t *mask, int first_row, int end_row) {
+    const uint64_t *bits = steg_mask_row(mask, first_row);
+    size_t words = mask->stride * (size_t)(end_row - first_row);
+    size_t count = 0;
+    for (size_t i = 0; i < words; i++) {
+        count += (size_t)__builtin_popcountll(bits[i]);
+    }
+    return count;
+}
+
+void steg_mask_set_run(steg_mask_t *mask, int y, int x, int count) {
+    uint64_t *row = mask->bits + (size_t)y * mask->stride;
+    while (count > 0) {
+        int bit = x & 63;
+        int n = 64 - bit < count ? 64 - bit : count;
+        uint64_t run = n == 64 ? ~0ULL : ((1ULL << n) - 1) << bit;
+        row[x >> 6] |= run;
+        x += n;
+        count -= n;
+    }
+}
+
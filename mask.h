@@ -0,0 +1,74 @@
+#ifndef MASK_H
+#define MASK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// embedding mask: one bit per pixel (set = can embed here), bit x % 64 of
+// word x / 64 in each row; rows are padded to whole 64-bit words so threads
+// working on different rows never share a word
+typedef struct {
+    int width;
+    int height;
+    size_t stride; // words per row
+    uint64_t *bits;
+} steg_mask_t;
+
+// all-clear mask, NULL if allocation failed
+steg_mask_t *steg_mask_create(int width, int height);
+
+void steg_mask_free(steg_mask_t *mask);
+
+// number of set pixels (popcount over all words)
+size_t steg_mask_count(const steg_mask_t *mask);
+
+// number of set pixels in rows [first_row, end_row)
+size_t steg_mask_count_rows(const steg_mask_t *mask, int first_row, int end_row);
+
+// set pixels [x, x + count) of row y
+void steg_mask_set_run(steg_mask_t *mask, int y, int x, int count);
+
+static inline const uint64_t *steg_mask_row(const steg_mask_t *mask, int y) {
+    return mask->bits + (size_t)y * mask->stride;
+}
+
+static inline bool steg_mask_test(const steg_mask_t *mask, int x, int y) {
+    return (steg_mask_row(mask, y)[x >> 6] >> (x & 63)) & 1;
+}
+
+// first set pixel at or after x in row y, or -1; skips empty words whole
+static inline int steg_mask_next(const steg_mask_t *mask, int y, int x) {
+    const uint64_t *row = steg_mask_row(mask, y);
+    size_t w = (size_t)x >> 6;
+    if (w >= mask->stride) {
+        return -1;
+    }
+    uint64_t word = row[w] & (~0ULL << (x & 63));
+    while (!word) {
+        if (++w >= mask->stride) {
+            return -1;
+        }
+        word = row[w];
+    }
+    return (int)(w * 64 + (size_t)__builtin_ctzll(word));
+}
+
+// first clear pixel at or after x in row y (width if the run reaches the
+// end of the row); whole set words are skipped
+static inline int steg_mask_run_end(const steg_mask_t *mask, int y, int x) {
+    const uint64_t *row = steg_mask_row(mask, y);
+    size_t w = (size_t)x >> 6;
+    uint64_t clear = w < mask->stride ? ~row[w] & (~0ULL << (x & 63)) : 0;
+    while (!clear && ++w < mask->stride) {
+        clear = ~row[w];
+    }
+    if (!clear) {
+        return mask->width;
+    }
+    int end = (int)(w * 64 + (size_t)__builtin_ctzll(clear));
+    return end < mask->width ? end : mask->width;
+}
+
+#endif
+
@@ -0,0 +1,81 @@
+#ifndef PNG_STREAM_H
+#define PNG_STREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "embedding.h"
+#include "png_write.h"
+
+// hiding and extraction for PNGs too large to decode at once. libpng reads
+// the image a band of rows at a time, twice: once for the global gray
+// median, once to analyse each band, embed into or extract from the rows it
+// finishes and, when hiding, write them out. memory stays at a few bands
+// whatever the image size. pixels keep the file's channels and 8 or 16-bit
+// samples, as the in-memory path loads them, so either path decodes what the
+// other wrote
+
+// image rows read per band
+#define STREAM_BAND_ROWS 256
+
+// mask of an EMBED_FORMAT_*, as the in-memory path computes it; the
+// EMBED_FORMAT_DEEP ones are block grids with their per-block depths
+typedef struct {
+    uint32_t format;
+    int invariant_planes;
+    bool blocks; // block grid instead of the per-pixel mask
+    bool legacy; // also accept the 4-byte header from before the versioned one
+    int median;  // global gray median for invariant_planes if known, -1 to compute it
+} stream_format_t;
+
+// true with the size filled in if path is a PNG the streaming path can
+// read (anything but interlaced)
+bool png_stream_probe(const char *path, int *width, int *height);
+
+// first pass on its own: the global gray median for every count of
+// invariant planes need flags (EMBED_DEPTH_MAX + 1 entries) into medians,
+// all from one read of the image; false if reading or allocation failed
+bool png_stream_medians(const char *path, const bool *need, int *medians);
+
+// hide the encrypted message in input_path and write the result to
+// output_path with the given PNG settings; false (and no output file) if
+// reading, writing or allocation failed or the image cannot hold the message
+bool png_stream_embed(const char *input_path,
+                      const char *output_path,
+                      const uint8_t *encrypted,
+                      size_t enc_len,
+                      const stream_format_t *format,
+                      const png_write_options_t *png_options);
+
+// whole-image load for the in-memory path with decoding and the analysis'
+// gray pass overlapped: a decoder thread inflates rows while pool threads
+// turn each band it finishes into gray and count its histogram. only that
+// pass is overlapped: every block test compares against the whole-image
+// median, known once the last row is in, so the block tests run afterwards
+// on the returned gray. returns the pixels (*channels samples of *depth
+// bits, 16-bit ones in host byte order) with *gray_out and *median_out as
+// grayscale_with_median gives them (both buffers for the caller to free),
+// NULL if reading or allocation failed
+uint8_t *png_stream_load(const char *path,
+                         int *width,
+                         int *height,
+                         int *channels,
+                         int *depth,
+                         int invariant_planes,
+                         uint8_t **gray_out,
+                         int *median_out);
+
+// extract a message of the given format; returns the encrypted length and
+// allocates *encrypted_out, 0 if there is none or reading failed
+size_t png_stream_extract(const char *path,
+                          const stream_format_t *format,
+                          uint8_t **encrypted_out);
+
+// only the header of a message of the given format, reading the image down
+// to the band it ends in; false if there is none or reading failed
+bool png_stream_read_header(const char *path,
+                            const stream_format_t *format,
+                            embed_header_t *header);
+
+#endif
@@ -0,0 +1,540 @@
+#include "png_write.h"
+
+#include <png.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "thread_pool.h"
+
+// bigger IDAT chunks than libpng's 8 KiB: fewer zlib flushes and chunk CRCs
+#define PNG_OUT_BUFFER (256 * 1024)
+
+// filtered bytes per chunk of the parallel encoder (about pigz's 128 KiB
+// block, rounded to whole rows); the sync flush and the dictionary priming
+// at each chunk start cost a few bytes and next to no ratio at that size
+#define PARALLEL_CHUNK (256 * 1024)
+
+// deflate's window: the dictionary a chunk starts from
+#define DEFLATE_WINDOW 32768
+
+// compressed chunk buffers keep room for the zlib header in front and the
+// adler32 behind, so the first and last chunk go out as one IDAT each
+#define ZLIB_HEADER_BYTES 2
+#define ZLIB_TRAILER_BYTES 4
+
+_Static_assert(PNG_OUT_FILTER_NONE == PNG_FILTER_NONE && PNG_OUT_FILTER_SUB == PNG_FILTER_SUB &&
+                   PNG_OUT_FILTER_UP == PNG_FILTER_UP && PNG_OUT_FILTER_AVG == PNG_FILTER_AVG &&
+                   PNG_OUT_FILTER_PAETH == PNG_FILTER_PAETH,
+               "filter bits are libpng's");
+
+// one chunk of a batch, filtered and then deflated by a pool thread
+typedef struct {
+    z_stream stream;
+    bool ready;      // stream initialised
+    uint8_t *output; // compressed data after ZLIB_HEADER_BYTES spare bytes
+    size_t capacity;
+    size_t length;
+    uLong adler;     // adler32 of the filtered bytes
+    int first_row;   // within the batch
+    int rows;
+    bool failed;
+} deflate_chunk_t;
+
+struct png_out {
+    png_structp png; // libpng encoder, NULL on the parallel path
+    png_infop info;
+    FILE *file;
+    size_t row_bytes;
+
+    // parallel path: rows gather in a batch of chunk_count chunks
+    int height;
+    bool swap;          // 16-bit samples to turn big-endian on the way in
+    int bpp;            // bytes per pixel, the sub / avg / paeth distance
+    int level;
+    int filters;
+    int chunk_rows;
+    int chunk_count;
+    deflate_chunk_t *chunks;
+    uint8_t *batch;     // raw rows not compressed yet
+    uint8_t *filtered;  // the batch filtered, each row behind its filter type
+    uint8_t *above;     // raw row over the batch, zeros over the image
+    uint8_t *window;    // last filtered bytes before the batch
+    size_t window_length;
+    int pending;        // rows in batch
+    int written;        // rows compressed and written
+    uLong adler;        // adler32 of everything compressed so far
+    bool failed;
+};
+
+typedef struct {
+    const char *name;
+    int value;
+} named_value_t;
+
+static const named_value_t filter_names[] = {
+    {"none", PNG_OUT_FILTER_NONE},
+    {"sub", PNG_OUT_FILTER_SUB},
+    {"up", PNG_OUT_FILTER_UP},
+    {"avg", PNG_OUT_FILTER_AVG},
+    {"paeth", PNG_OUT_FILTER_PAETH},
+    {"all", PNG_OUT_FILTER_ALL},
+};
+
+static const named_value_t strategy_names[] = {
+    {"default", PNG_OUT_STRATEGY_DEFAULT},
+    {"filtered", PNG_OUT_STRATEGY_FILTERED},
+    {"huffman", PNG_OUT_STRATEGY_HUFFMAN},
+    {"rle", PNG_OUT_STRATEGY_RLE},
+    {"fixed", PNG_OUT_STRATEGY_FIXED},
+};
+
+static const int zlib_strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED};
+
+static bool find_value(const named_value_t *values, size_t count, const char *name, int *out) {
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(values[i].name, name) == 0) {
+            *out = values[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+void png_write_options_default(png_write_options_t *options) {
+    options->level = 1;
+    options->filters = PNG_OUT_FILTER_ALL;
+    options->strategy = PNG_OUT_STRATEGY_DEFAULT;
+    options->parallel = true;
+}
+
+bool png_write_options_set(png_write_options_t *options, const char *name, const char *value) {
+    if (strcmp(name, "level") == 0) {
+        if (strcmp(value, "store") == 0) {
+            options->level = 0;
+            return true;
+        }
+        char *end;
+        long level = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || level < 0 || level > 9) {
+            return false;
+        }
+        options->level = (int)level;
+        return true;
+    }
+    if (strcmp(name, "filter") == 0) {
+        return find_value(filter_names, sizeof(filter_names) / sizeof(filter_names[0]), value,
+                          &options->filters);
+    }
+    if (strcmp(name, "strategy") == 0) {
+        return find_value(strategy_names, sizeof(strategy_names) / sizeof(strategy_names[0]),
+                          value, &options->strategy);
+    }
+    return false;
+}
+
+bool png_write_options_from_env(png_write_options_t *options) {
+    static const char *vars[][2] = {
+        {"STEG_PNG_LEVEL", "level"},
+        {"STEG_PNG_FILTER", "filter"},
+        {"STEG_PNG_STRATEGY", "strategy"},
+    };
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+        const char *value = getenv(vars[i][0]);
+        if (value && *value && !png_write_options_set(options, vars[i][1], value)) {
+            printf("❌ invalid %s '%s', ignored\n", vars[i][0], value);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static const int color_types[] = {PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
+                                  PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA};
+
+static bool host_little_endian(void) {
+    return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+// one PNG chunk: length, type, data, crc of type and data
+static bool write_chunk(FILE *file, const char *type, const uint8_t *data, size_t length) {
+    uint8_t head[8];
+    uint8_t tail[4];
+    put_be32(head, (uint32_t)length);
+    memcpy(head + 4, type, 4);
+    uLong crc = crc32(crc32(0L, Z_NULL, 0), head + 4, 4);
+    if (length > 0) {
+        crc = crc32(crc, data, (uInt)length); // a NULL buffer would reset it
+    }
+    put_be32(tail, (uint32_t)crc);
+    return fwrite(head, 1, 8, file) == 8 &&
+           (length == 0 || fwrite(data, 1, length, file) == length) &&
+           fwrite(tail, 1, 4, file) == 4;
+}
+
+static inline int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// row run through PNG filter type (0 none, 1 sub, 2 up, 3 avg, 4 paeth)
+// against the raw row above, into out unless it is NULL. returns libpng's
+// selection cost: the filtered bytes summed as signed magnitudes
+static uint64_t filter_row(int type, const uint8_t *row, const uint8_t *above, size_t length,
+                           int bpp, uint8_t *out) {
+    uint64_t cost = 0;
+    for (size_t i = 0; i < length; i++) {
+        int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+        int b = above[i];
+        int c = i >= (size_t)bpp ? above[i - bpp] : 0;
+        int predicted = type == 0   ? 0
+                        : type == 1 ? a
+                        : type == 2 ? b
+                        : type == 3 ? (a + b) >> 1
+                                    : paeth(a, b, c);
+        uint8_t f = (uint8_t)(row[i] - predicted);
+        cost += f < 128 ? f : 256 - f;
+        if (out) {
+            out[i] = f;
+        }
+    }
+    return cost;
+}
+
+// pool task: filter the rows of one chunk, each with the allowed filter of
+// lowest cost like libpng's adaptive choice
+static void filter_chunk(void *arg, int index) {
+    png_out_t *out = (png_out_t *)arg;
+    const deflate_chunk_t *chunk = &out->chunks[index];
+    bool choose = __builtin_popcount((unsigned)out->filters) > 1;
+
+    for (int r = chunk->first_row; r < chunk->first_row + chunk->rows; r++) {
+        const uint8_t *row = out->batch + (size_t)r * out->row_bytes;
+        const uint8_t *above = r == 0 ? out->above : row - out->row_bytes;
+        uint8_t *dest = out->filtered + (size_t)r * (out->row_bytes + 1);
+
+        int best = 0;
+        uint64_t best_cost = UINT64_MAX;
+        for (int type = 0; type < 5; type++) {
+            if (!(out->filters & (PNG_OUT_FILTER_NONE << type))) {
+                continue;
+            }
+            uint64_t cost = choose ? filter_row(type, row, above, out->row_bytes, out->bpp, NULL) : 0;
+            if (cost < best_cost) {
+                best = type;
+                best_cost = cost;
+            }
+        }
+        dest[0] = (uint8_t)best;
+        filter_row(best, row, above, out->row_bytes, out->bpp, dest + 1);
+    }
+}
+
+// pool task: deflate one filtered chunk on its own stream, primed with the
+// bytes before it, ending on a sync flush (the image's last chunk finishes
+// the stream instead) so the output joins byte-aligned to the next chunk's
+static void deflate_chunk(void *arg, int index) {
+    png_out_t *out = (png_out_t *)arg;
+    deflate_chunk_t *chunk = &out->chunks[index];
+    size_t stride = out->row_bytes + 1;
+    uint8_t *data = out->filtered + (size_t)chunk->first_row * stride;
+    size_t length = (size_t)chunk->rows * stride;
+
+    const uint8_t *dictionary = out->window;
+    size_t dictionary_length = out->window_length;
+    if (index > 0) {
+        size_t before = (size_t)chunk->first_row * stride;
+        dictionary_length = before < DEFLATE_WINDOW ? before : DEFLATE_WINDOW;
+        dictionary = data - dictionary_length;
+    }
+    bool last = out->written + chunk->first_row + chunk->rows == out->height;
+
+    z_stream *stream = &chunk->stream;
+    chunk->adler = adler32(adler32(0L, Z_NULL, 0), data, (uInt)length);
+    chunk->failed = deflateReset(stream) != Z_OK ||
+                    (dictionary_length > 0 &&
+                     deflateSetDictionary(stream, dictionary, (uInt)dictionary_length) != Z_OK);
+    if (chunk->failed) {
+        return;
+    }
+
+    size_t room = chunk->capacity - ZLIB_HEADER_BYTES - ZLIB_TRAILER_BYTES;
+    stream->next_in = data;
+    stream->avail_in = (uInt)length;
+    stream->next_out = chunk->output + ZLIB_HEADER_BYTES;
+    stream->avail_out = (uInt)room;
+    int status = deflate(stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    // a sync flush is only complete if it did not run out of room
+    chunk->failed = last ? status != Z_STREAM_END
+                         : status != Z_OK || stream->avail_in != 0 || stream->avail_out == 0;
+    chunk->length = room - stream->avail_out;
+}
+
+// zlib stream header for a level: deflate with a 32 KiB window, the level
+// hint, check bits making it a multiple of 31
+static void zlib_header(uint8_t *header, int level) {
+    int hint = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    header[0] = 0x78;
+    header[1] = (uint8_t)(hint << 6);
+    header[1] |= (uint8_t)(31 - ((header[0] << 8 | header[1]) % 31));
+}
+
+// filter and deflate the pending rows on the pool, then write the chunks
+// out in order as IDATs
+static bool compress_batch(png_out_t *out) {
+    int count = (out->pending + out->chunk_rows - 1) / out->chunk_rows;
+    for (int c = 0; c < count; c++) {
+        deflate_chunk_t *chunk = &out->chunks[c];
+        chunk->first_row = c * out->chunk_rows;
+        chunk->rows = out->pending - chunk->first_row < out->chunk_rows
+                          ? out->pending - chunk->first_row
+                          : out->chunk_rows;
+    }
+    thread_pool_run(filter_chunk, out, count);
+    thread_pool_run(deflate_chunk, out, count);
+
+    size_t stride = out->row_bytes + 1;
+    bool done = out->written + out->pending == out->height;
+    for (int c = 0; c < count; c++) {
+        deflate_chunk_t *chunk = &out->chunks[c];
+        if (chunk->failed) {
+            return false;
+        }
+        uint8_t *data = chunk->output + ZLIB_HEADER_BYTES;
+        size_t length = chunk->length;
+        if (out->written == 0 && c == 0) {
+            data -= ZLIB_HEADER_BYTES;
+            length += ZLIB_HEADER_BYTES;
+            zlib_header(data, out->level);
+        }
+        out->adler = adler32_combine(out->adler, chunk->adler, (z_off_t)chunk->rows * stride);
+        if (done && c == count - 1) {
+            put_be32(data + length, (uint32_t)out->adler);
+            length += ZLIB_TRAILER_BYTES;
+        }
+        if (!write_chunk(out->file, "IDAT", data, length)) {
+            return false;
+        }
+    }
+
+    // the next batch's dictionary and row above
+    const deflate_chunk_t *tail = &out->chunks[count - 1];
+    size_t tail_length = (size_t)tail->rows * stride;
+    out->window_length = tail_length < DEFLATE_WINDOW ? tail_length : DEFLATE_WINDOW;
+    memcpy(out->window, out->filtered + (size_t)out->pending * stride - out->window_length,
+           out->window_length);
+    memcpy(out->above, out->batch + (size_t)(out->pending - 1) * out->row_bytes, out->row_bytes);
+    out->written += out->pending;
+    out->pending = 0;
+    return true;
+}
+
+// set up the parallel path and write the signature and header; false if
+// allocation or writing failed
+static bool parallel_open(png_out_t *out, int width, int height, int channels, int depth,
+                          const png_write_options_t *options) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    size_t stride = out->row_bytes + 1;
+    out->height = height;
+    out->bpp = channels * depth / 8;
+    out->swap = depth == 16 && host_little_endian();
+    out->level = options->level;
+    out->filters = options->level == 0 ? PNG_OUT_FILTER_NONE : options->filters;
+    out->chunk_rows = stride < PARALLEL_CHUNK ? (int)(PARALLEL_CHUNK / stride) : 1;
+    out->chunk_count = thread_pool_size();
+    if (out->chunk_rows > height) {
+        out->chunk_rows = height;
+    }
+    out->adler = adler32(0L, Z_NULL, 0);
+
+    size_t batch_rows = (size_t)out->chunk_rows * (size_t)out->chunk_count;
+    out->chunks = (deflate_chunk_t *)calloc((size_t)out->chunk_count, sizeof(deflate_chunk_t));
+    out->batch = (uint8_t *)malloc(batch_rows * out->row_bytes);
+    out->filtered = (uint8_t *)malloc(batch_rows * stride);
+    out->above = (uint8_t *)calloc(out->row_bytes, 1);
+    out->window = (uint8_t *)malloc(DEFLATE_WINDOW);
+    if (!out->chunks || !out->batch || !out->filtered || !out->above || !out->window) {
+        return false; // allocation failed
+    }
+    for (int c = 0; c < out->chunk_count; c++) {
+        deflate_chunk_t *chunk = &out->chunks[c];
+        // raw deflate: the zlib header and trailer are written around the chunks
+        chunk->ready = deflateInit2(&chunk->stream, options->level, Z_DEFLATED, -15, 8,
+                                    zlib_strategies[options->strategy]) == Z_OK;
+        if (!chunk->ready) {
+            return false;
+        }
+        chunk->capacity = deflateBound(&chunk->stream, (uLong)out->chunk_rows * stride) + 16 +
+                          ZLIB_HEADER_BYTES + ZLIB_TRAILER_BYTES;
+        chunk->output = (uint8_t *)malloc(chunk->capacity);
+        if (!chunk->output) {
+            return false; // allocation failed
+        }
+    }
+
+    uint8_t ihdr[13];
+    put_be32(ihdr, (uint32_t)width);
+    put_be32(ihdr + 4, (uint32_t)height);
+    ihdr[8] = (uint8_t)depth;
+    ihdr[9] = (uint8_t)color_types[channels - 1];
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filtering
+    ihdr[12] = 0; // not interlaced
+    return fwrite(signature, 1, sizeof(signature), out->file) == sizeof(signature) &&
+           write_chunk(out->file, "IHDR", ihdr, sizeof(ihdr));
+}
+
+// libpng writer and header; setjmp lives here, apart from the caller's
+// locals, so a longjmp cannot clobber them
+static bool libpng_open(png_out_t *out, int width, int height, int channels, int depth,
+                        const png_write_options_t *options) {
+    out->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    out->info = out->png ? png_create_info_struct(out->png) : NULL;
+    if (!out->info) {
+        return false; // allocation failed
+    }
+    if (setjmp(png_jmpbuf(out->png))) {
+        return false;
+    }
+
+    png_init_io(out->png, out->file);
+    png_set_compression_level(out->png, options->level);
+    png_set_compression_strategy(out->png, zlib_strategies[options->strategy]);
+    png_set_compression_buffer_size(out->png, PNG_OUT_BUFFER);
+    // stored data gains nothing from filtering, so skip the filter search
+    png_set_filter(out->png, PNG_FILTER_TYPE_BASE,
+                   options->level == 0 ? PNG_FILTER_NONE : options->filters);
+
+    png_set_IHDR(out->png, out->info, (png_uint_32)width, (png_uint_32)height, depth,
+                 color_types[channels - 1], PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(out->png, out->info);
+    if (depth == 16 && host_little_endian()) {
+        png_set_swap(out->png); // PNG stores 16-bit samples big-endian
+    }
+    return true;
+}
+
+// the next `count` rows through libpng
+static bool libpng_rows(png_out_t *out, const uint8_t *rows, int count) {
+    if (setjmp(png_jmpbuf(out->png))) {
+        return false; // write error
+    }
+    for (int y = 0; y < count; y++) {
+        png_write_row(out->png, rows + (size_t)y * out->row_bytes);
+    }
+    return true;
+}
+
+png_out_t *png_out_open(FILE *file, int width, int height, int channels, int depth,
+                        const png_write_options_t *options) {
+    if (channels < 1 || channels > 4 || (depth != 8 && depth != 16) || width < 1 || height < 1) {
+        return NULL;
+    }
+
+    png_out_t *out = (png_out_t *)calloc(1, sizeof(png_out_t));
+    if (!out) {
+        return NULL; // allocation failed
+    }
+    out->file = file;
+    out->row_bytes = (size_t)width * (size_t)channels * (size_t)(depth / 8);
+    bool opened = options->parallel && thread_pool_size() > 1
+                      ? parallel_open(out, width, height, channels, depth, options)
+                      : libpng_open(out, width, height, channels, depth, options);
+    if (!opened) {
+        png_out_free(out);
+        return NULL;
+    }
+    return out;
+}
+
+bool png_out_rows(png_out_t *out, const uint8_t *rows, int count) {
+    if (!out->png) {
+        int batch_rows = out->chunk_rows * out->chunk_count;
+        while (count > 0 && !out->failed) {
+            int n = batch_rows - out->pending < count ? batch_rows - out->pending : count;
+            if (out->written + out->pending + n > out->height) {
+                out->failed = true; // more rows than the image has
+                break;
+            }
+            uint8_t *dst = out->batch + (size_t)out->pending * out->row_bytes;
+            size_t bytes = (size_t)n * out->row_bytes;
+            if (out->swap) {
+                for (size_t i = 0; i < bytes; i += 2) {
+                    dst[i] = rows[i + 1];
+                    dst[i + 1] = rows[i];
+                }
+            } else {
+                memcpy(dst, rows, bytes);
+            }
+            out->pending += n;
+            rows += (size_t)n * out->row_bytes;
+            count -= n;
+            if (out->pending == batch_rows || out->written + out->pending == out->height) {
+                out->failed = !compress_batch(out);
+            }
+        }
+        return !out->failed;
+    }
+    return libpng_rows(out, rows, count);
+}
+
+bool png_out_finish(png_out_t *out) {
+    if (!out->png) {
+        return !out->failed && out->written == out->height &&
+               write_chunk(out->file, "IEND", NULL, 0) && fflush(out->file) == 0;
+    }
+    if (setjmp(png_jmpbuf(out->png))) {
+        return false;
+    }
+    png_write_end(out->png, NULL);
+    return fflush(out->file) == 0;
+}
+
+void png_out_free(png_out_t *out) {
+    if (!out) {
+        return;
+    }
+    if (out->png) {
+        png_destroy_write_struct(&out->png, out->info ? &out->info : NULL);
+    }
+    for (int c = 0; out->chunks && c < out->chunk_count; c++) {
+        if (out->chunks[c].ready) {
+            deflateEnd(&out->chunks[c].stream);
+        }
+        free(out->chunks[c].output);
+    }
+    free(out->chunks);
+    free(out->batch);
+    free(out->filtered);
+    free(out->above);
+    free(out->window);
+    free(out);
+}
+
+bool png_write_file(const char *path, int width, int height, int channels, int depth,
+                    const uint8_t *pixels, const png_write_options_t *options) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    png_out_t *out = png_out_open(file, width, height, channels, depth, options);
+    bool ok = out && png_out_rows(out, pixels, height) && png_out_finish(out);
+    png_out_free(out);
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        remove(path);
+    }
+    return ok;
+}
@@ -0,0 +1,71 @@
+#ifndef PNG_WRITE_H
+#define PNG_WRITE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// PNG output through libpng and zlib, with the speed / size trade-off open:
+// stb's encoder has its own slow deflate and one fixed filter heuristic.
+// with more than one pool thread the image data is instead filtered and
+// deflated pigz-style: rows are cut into chunks that pool threads compress
+// at once, each primed with the 32 KiB before it and ended on a sync flush,
+// so the pieces join into one ordinary zlib stream
+
+// row filters libpng may pick from (several = per-row adaptive choice)
+#define PNG_OUT_FILTER_NONE 0x08
+#define PNG_OUT_FILTER_SUB 0x10
+#define PNG_OUT_FILTER_UP 0x20
+#define PNG_OUT_FILTER_AVG 0x40
+#define PNG_OUT_FILTER_PAETH 0x80
+#define PNG_OUT_FILTER_ALL 0xF8
+
+// zlib strategies
+#define PNG_OUT_STRATEGY_DEFAULT 0
+#define PNG_OUT_STRATEGY_FILTERED 1
+#define PNG_OUT_STRATEGY_HUFFMAN 2
+#define PNG_OUT_STRATEGY_RLE 3
+#define PNG_OUT_STRATEGY_FIXED 4
+
+typedef struct {
+    int level;    // zlib level: 0 stores uncompressed, 1 fastest .. 9 smallest
+    int filters;  // PNG_OUT_FILTER_* bits
+    int strategy; // PNG_OUT_STRATEGY_*
+    bool parallel; // deflate on the worker pool when it has several threads
+} png_write_options_t;
+
+// zlib's fastest level 1 with adaptive filtering, parallel: on photo-like
+// content it beats stb on both time and size (steg_bench pngwrite)
+void png_write_options_default(png_write_options_t *options);
+
+// set one option from its text form: "level" takes 0-9 or "store", "filter"
+// none, sub, up, avg, paeth or all, "strategy" default, filtered, huffman,
+// rle or fixed. false if the name or value is unknown
+bool png_write_options_set(png_write_options_t *options, const char *name, const char *value);
+
+// apply STEG_PNG_LEVEL, STEG_PNG_FILTER and STEG_PNG_STRATEGY when set;
+// false if one of them is invalid (the others still apply)
+bool png_write_options_from_env(png_write_options_t *options);
+
+// a PNG being written row by row: 1 (gray), 2 (gray + alpha), 3 (rgb) or
+// 4 (rgba) channels of 8-bit or native-endian 16-bit samples
+typedef struct png_out png_out_t;
+
+// start a PNG on an open file, which stays the caller's to close; NULL if
+// allocation or writing the header failed
+png_out_t *png_out_open(FILE *file, int width, int height, int channels, int depth,
+                        const png_write_options_t *options);
+
+// append `count` rows, packed one after another
+bool png_out_rows(png_out_t *out, const uint8_t *rows, int count);
+
+// write the end of the image and flush the file
+bool png_out_finish(png_out_t *out);
+
+void png_out_free(png_out_t *out);
+
+// whole image to path in one go; false if anything failed
+bool png_write_file(const char *path, int width, int height, int channels, int depth,
+                    const uint8_t *pixels, const png_write_options_t *options);
+
+#endif
@@ -0,0 +1,229 @@
+#include "probe.h"
+#include "image_analysis.h"
+#include "png_stream.h"
+
+#include <stdlib.h>
+
+// rows per band of the median pass and per push of the prefix analysis
+#define PROBE_BAND_ROWS 64
+
+const uint32_t probe_formats[PROBE_FORMAT_COUNT] = {
+    EMBED_FORMAT_PIXELS,  EMBED_FORMAT_BLOCKS,  EMBED_FORMAT_DEEP(2),
+    EMBED_FORMAT_DEEP(3), EMBED_FORMAT_DEEP(4), EMBED_FORMAT_LEGACY,
+};
+
+int probe_invariant_planes(uint32_t format) {
+    if (format == EMBED_FORMAT_LEGACY) {
+        return 0;
+    }
+    int depth = embed_format_depth(format);
+    return depth > MASK_INVARIANT_PLANES ? depth : MASK_INVARIANT_PLANES;
+}
+
+bool probe_is_blocks(uint32_t format) {
+    return format == EMBED_FORMAT_BLOCKS || embed_format_depth(format) > 1;
+}
+
+const char *probe_format_name(uint32_t format) {
+    static const char *deep_names[] = {"lsb2", "lsb3", "lsb4"};
+    if (format == EMBED_FORMAT_PIXELS) {
+        return "pixels";
+    }
+    if (format == EMBED_FORMAT_BLOCKS) {
+        return "blocks";
+    }
+    int depth = embed_format_depth(format);
+    return depth > 1 ? deep_names[depth - 2] : "legacy";
+}
+
+embed_plan_t *probe_format_plan(const probe_image_t *img, uint32_t format, size_t min_pixels) {
+    int planes = probe_invariant_planes(format);
+    analysis_options_t options = {planes, min_pixels, NULL, 0, img->depth};
+    if (img->gray && planes == MASK_INVARIANT_PLANES) {
+        options.gray = img->gray;
+        options.global_median = img->median;
+    }
+    embed_layout_t layout = embed_layout_for(img->channels, img->depth);
+
+    if (probe_is_blocks(format)) {
+        // k-LSB formats also get each block's depth
+        int max_depth = embed_format_depth(format);
+        uint8_t *depths = NULL;
+        steg_mask_t *grid = find_low_contrast_blocks_depths(img->pixels, img->width, img->height,
+                                                            img->channels, &options, max_depth,
+                                                            max_depth > 1 ? &depths : NULL);
+        embed_plan_t *plan = grid ? embed_plan_create_blocks(grid, BLOCK_SIZE, img->width,
+                                                             &layout, depths)
+                                  : NULL;
+        steg_mask_free(grid);
+        free(depths);
+        return plan;
+    }
+
+    steg_mask_t *mask = find_low_contrast_regions_with(img->pixels, img->width, img->height,
+                                                       img->channels, &options);
+    embed_plan_t *plan = mask ? embed_plan_create(mask, &layout) : NULL;
+    steg_mask_free(mask);
+    return plan;
+}
+
+// global medians of the gray copies with the invariant planes `need` flags,
+// in one pass a band at a time, so that each band is still in cache for
+// every copy after the first; only a band of gray is ever held
+static bool gray_medians(const probe_image_t *img, const bool *need, int *medians) {
+    size_t row_bytes = (size_t)img->width * (size_t)img->channels * (size_t)(img->depth / 8);
+    uint8_t *gray = (uint8_t *)malloc((size_t)PROBE_BAND_ROWS * (size_t)img->width);
+    uint64_t(*hists)[256] = (uint64_t(*)[256])calloc(EMBED_DEPTH_MAX + 1, sizeof(*hists));
+    bool ok = gray && hists;
+
+    for (int y = 0; ok && y < img->height; y += PROBE_BAND_ROWS) {
+        int rows = img->height - y < PROBE_BAND_ROWS ? img->height - y : PROBE_BAND_ROWS;
+        for (int planes = 0; ok && planes <= EMBED_DEPTH_MAX; planes++) {
+            ok = !need[planes] ||
+                 grayscale_rows(img->pixels + (size_t)y * row_bytes, img->width, rows,
+                                img->channels, img->depth, planes, gray, hists[planes]);
+        }
+    }
+    uint64_t total = (uint64_t)img->width * (uint64_t)img->height;
+    for (int planes = 0; ok && planes <= EMBED_DEPTH_MAX; planes++) {
+        if (need[planes]) {
+            medians[planes] = gray_histogram_median(hists[planes], total);
+        }
+    }
+
+    free(hists);
+    free(gray);
+    return ok;
+}
+
+// the header of one format, read through its mask as streaming analysis
+// gives it a band at a time from the top, until the header is settled
+static embed_header_status_t read_prefix_header(const probe_image_t *img, uint32_t format,
+                                                int median, bool legacy,
+                                                embed_header_t *header) {
+    embed_layout_t layout = embed_layout_for(img->channels, img->depth);
+    size_t row_bytes = (size_t)img->width * (size_t)img->channels * (size_t)(img->depth / 8);
+    size_t max_planes = (size_t)(layout.planes + embed_format_depth(format) - 1);
+    size_t max_slots = (size_t)img->width * (size_t)img->height *
+                       (size_t)layout.color_channels * max_planes;
+    bool blocks = probe_is_blocks(format);
+    stream_analysis_t *sa = stream_analysis_create(img->width, img->height, img->channels,
+                                                   img->depth, median,
+                                                   probe_invariant_planes(format), blocks,
+                                                   embed_format_depth(format), PROBE_BAND_ROWS);
+    if (!sa) {
+        return EMBED_HEADER_NONE; // allocation failed
+    }
+
+    uint8_t bytes[EMBED_HEADER_MAX_BYTES];
+    embed_header_status_t status = EMBED_HEADER_MORE;
+    header->bytes = EMBED_HEADER_FIXED_BYTES;
+    size_t read = 0;
+    size_t bits = 0;
+    int done = 0; // rows the plans so far covered
+    for (int y = 0; y < img->height && status == EMBED_HEADER_MORE; y += PROBE_BAND_ROWS) {
+        int rows = img->height - y < PROBE_BAND_ROWS ? img->height - y : PROBE_BAND_ROWS;
+        int finished = stream_analysis_push(sa, img->pixels + (size_t)y * row_bytes, rows);
+        const steg_mask_t *mask = finished >= 0 ? stream_analysis_mask(sa) : NULL;
+        embed_plan_t *plan = !mask ? NULL
+                             : blocks ? embed_plan_create_blocks(mask, BLOCK_SIZE, img->width,
+                                                                 &layout,
+                                                                 stream_analysis_depths(sa))
+                                      : embed_plan_create(mask, &layout);
+        if (!plan) {
+            status = EMBED_HEADER_NONE; // allocation failed
+            break;
+        }
+        embed_plan_rebase(plan, bits);
+        bits += plan->capacity;
+
+        while (status == EMBED_HEADER_MORE && read < bits) {
+            size_t want = header->bytes * 8;
+            size_t end = bits < want ? bits : want;
+            extract_bits(img->pixels + (size_t)done * row_bytes, plan, bytes, read, end);
+            read = end;
+            if (read < want) {
+                break;
+            }
+            status = embed_header_parse(bytes, header->bytes, format, max_slots, legacy, header);
+        }
+        embed_plan_free(plan);
+        done = finished;
+    }
+
+    stream_analysis_free(sa);
+    return status == EMBED_HEADER_FOUND ? EMBED_HEADER_FOUND : EMBED_HEADER_NONE;
+}
+
+// which invariant plane counts the formats' medians are taken with
+static void medians_needed(bool *need) {
+    for (int planes = 0; planes <= EMBED_DEPTH_MAX; planes++) {
+        need[planes] = false;
+    }
+    for (int f = 0; f < PROBE_FORMAT_COUNT; f++) {
+        need[probe_invariant_planes(probe_formats[f])] = true;
+    }
+}
+
+bool probe_image(const probe_image_t *img, bool legacy, probe_result_t *result) {
+    // the medians the loader did not bring, all in one pass, the first time
+    // a format needs one
+    bool need[EMBED_DEPTH_MAX + 1];
+    int medians[EMBED_DEPTH_MAX + 1] = {0};
+    medians_needed(need);
+    if (img->gray) {
+        need[MASK_INVARIANT_PLANES] = false;
+        medians[MASK_INVARIANT_PLANES] = img->median;
+    }
+    bool pending = true;
+
+    // a legacy header has no magic or CRC, so it is only looked for through
+    // the full-byte mask it was written with; that format comes last, once
+    // no other has a versioned header
+    for (int f = 0; f < PROBE_FORMAT_COUNT; f++) {
+        uint32_t format = probe_formats[f];
+        int planes = probe_invariant_planes(format);
+        if (need[planes] && pending) {
+            if (!gray_medians(img, need, medians)) {
+                return false; // allocation failed
+            }
+            pending = false;
+        }
+
+        embed_header_t header;
+        if (read_prefix_header(img, format, medians[planes],
+                               legacy && format == EMBED_FORMAT_LEGACY,
+                               &header) == EMBED_HEADER_FOUND) {
+            result->format = format;
+            result->header = header;
+            result->median = medians[planes];
+            return true;
+        }
+    }
+    return false;
+}
+
+bool probe_png_stream(const char *path, bool legacy, probe_result_t *result) {
+    bool need[EMBED_DEPTH_MAX + 1];
+    int medians[EMBED_DEPTH_MAX + 1] = {0};
+    medians_needed(need);
+    if (!png_stream_medians(path, need, medians)) {
+        return false;
+    }
+
+    // legacy headers taken as probe_image takes them
+    for (int f = 0; f < PROBE_FORMAT_COUNT; f++) {
+        uint32_t format = probe_formats[f];
+        int planes = probe_invariant_planes(format);
+        stream_format_t settings = {format, planes, probe_is_blocks(format),
+                                    legacy && format == EMBED_FORMAT_LEGACY, medians[planes]};
+        embed_header_t header;
+        if (png_stream_read_header(path, &settings, &header)) {
+            result->format = format;
+            result->header = header;
+            result->median = medians[planes];
+            return true;
+        }
+    }
+    return false;
+}
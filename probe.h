@@ -0,0 +1,70 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "embedding.h"
+
+// telling images that carry a message from the ones that do not, without
+// extracting: each format's mask is computed by the streaming analysis only
+// down to the rows holding the header's slots, and an image without one
+// fails the magic or CRC there. what stays whole-image is the gray histogram
+// behind each global median, all of them taken in one pass
+
+// low bit planes the mask statistics ignore: the embedded one
+#define MASK_INVARIANT_PLANES 1
+
+// formats the decoder tries, in order; EMBED_FORMAT_LEGACY, the only one a
+// legacy header is read through, comes last
+#define PROBE_FORMAT_COUNT 6
+extern const uint32_t probe_formats[PROBE_FORMAT_COUNT];
+
+// a decoded image: `channels` interleaved samples of `depth` bits (16-bit
+// ones as native-endian uint16_t), with the loader's gray copy of
+// MASK_INVARIANT_PLANES and its median when it made one, gray NULL if not
+typedef struct {
+    uint8_t *pixels;
+    int width;
+    int height;
+    int channels;
+    int depth;
+    const uint8_t *gray;
+    int median;
+} probe_image_t;
+
+// low bit planes the statistics of an EMBED_FORMAT_* ignore: none for the
+// legacy mask, every plane a k-LSB format may write
+int probe_invariant_planes(uint32_t format);
+
+// whether an EMBED_FORMAT_* uses the block grid rather than the pixel mask
+bool probe_is_blocks(uint32_t format);
+
+// short name of an EMBED_FORMAT_*: "pixels", "blocks", "lsb2" .. "lsb4" or
+// "legacy"
+const char *probe_format_name(uint32_t format);
+
+// mask of an EMBED_FORMAT_* turned into its embedding plan, complete down
+// to min_pixels as in analysis_options_t (0 for the whole image); NULL if
+// allocation failed
+embed_plan_t *probe_format_plan(const probe_image_t *img, uint32_t format, size_t min_pixels);
+
+typedef struct {
+    uint32_t format; // EMBED_FORMAT_* whose mask the header was read through
+    embed_header_t header;
+    int median; // global gray median the format's mask was computed with
+} probe_result_t;
+
+// look for a message header in every format: versioned headers first, then
+// a legacy one through the legacy mask when `legacy` is set, as the decoder
+// does. true with *result
+// filled in if there is one, false if not or allocation failed
+bool probe_image(const probe_image_t *img, bool legacy, probe_result_t *result);
+
+// probe_image for a PNG the streaming path reads instead of loading: one
+// pass for all the global medians, then each format's mask down to the band
+// its header ends in. false if there is no header or reading failed
+bool probe_png_stream(const char *path, bool legacy, probe_result_t *result);
+
+#endif
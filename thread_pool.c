@@ -0,0 +1,278 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// upper bound on pool threads, whatever the CPU count or override says
+#define MAX_POOL_THREADS 256
+
+// keeps each slot's lock and range on its own cache line
+#define CACHE_LINE 64
+
+// the indices a thread still owns in a job; others steal from its end
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    atomic_int next; // changed under lock, read without it when picking a victim
+    atomic_int end;
+} slot_t;
+
+// one thread_pool_run call; lives on the caller's stack
+typedef struct job {
+    pool_task_fn fn;
+    void *arg;
+    int count;
+    slot_t *slots;      // one per participating thread
+    int slot_count;
+    atomic_int done;    // finished indices
+    int users;          // pool threads looking at this job (pool mutex)
+    struct job *link;   // next job that may still have indices
+} job_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t work;     // a job was queued
+    pthread_cond_t finished; // a job completed or a thread let go of one
+    job_t *head;             // jobs that may still have indices to hand out
+    int size;                // pool threads + 1 (the caller)
+    int limit;               // threads allowed to take part, 0 = all
+} pool_t;
+
+static pool_t pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    NULL,
+    0,
+    0,
+};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static int requested_size = 0;
+
+// slot used by this thread: pool threads are 1 .. size - 1, anything else 0
+static _Thread_local int worker_id = 0;
+
+// take an index from our own slot, or steal the back half of the fullest
+// other slot. returns -1 once every slot is empty
+static int take_index(job_t *job, int self) {
+    slot_t *own = &job->slots[self];
+
+    pthread_mutex_lock(&own->lock);
+    int index = atomic_load_explicit(&own->next, memory_order_relaxed);
+    if (index < atomic_load_explicit(&own->end, memory_order_relaxed)) {
+        atomic_store_explicit(&own->next, index + 1, memory_order_relaxed);
+        pthread_mutex_unlock(&own->lock);
+        return index;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    while (1) {
+        // pick a victim without locking; the range is re-checked under its lock
+        int victim = -1;
+        int most = 0;
+        for (int i = 0; i < job->slot_count; i++) {
+            int left = atomic_load_explicit(&job->slots[i].end, memory_order_relaxed) -
+                       atomic_load_explicit(&job->slots[i].next, memory_order_relaxed);
+            if (i != self && left > most) {
+                most = left;
+                victim = i;
+            }
+        }
+        if (victim < 0) {
+            return -1;
+        }
+
+        slot_t *from = &job->slots[victim];
+        pthread_mutex_lock(&from->lock);
+        int end = atomic_load_explicit(&from->end, memory_order_relaxed);
+        int left = end - atomic_load_explicit(&from->next, memory_order_relaxed);
+        if (left <= 0) {
+            pthread_mutex_unlock(&from->lock);
+            continue; // someone got there first, look again
+        }
+        int take = (left + 1) / 2;
+        int first = end - take;
+        atomic_store_explicit(&from->end, first, memory_order_relaxed);
+        pthread_mutex_unlock(&from->lock);
+
+        // keep the rest of the stolen range for ourselves
+        pthread_mutex_lock(&own->lock);
+        atomic_store_explicit(&own->next, first + 1, memory_order_relaxed);
+        atomic_store_explicit(&own->end, first + take, memory_order_relaxed);
+        pthread_mutex_unlock(&own->lock);
+        return first;
+    }
+}
+
+static void run_indices(job_t *job, int self) {
+    int index;
+    while ((index = take_index(job, self)) >= 0) {
+        job->fn(job->arg, index);
+        if (atomic_fetch_add(&job->done, 1) + 1 == job->count) {
+            pthread_mutex_lock(&pool.mutex);
+            pthread_cond_broadcast(&pool.finished);
+            pthread_mutex_unlock(&pool.mutex);
+        }
+    }
+}
+
+// drop a job from the queue; caller holds the mutex
+static void unlink_job(job_t *job) {
+    for (job_t **link = &pool.head; *link; link = &(*link)->link) {
+        if (*link == job) {
+            *link = job->link;
+            return;
+        }
+    }
+}
+
+static void *pool_worker(void *arg) {
+    worker_id = (int)(intptr_t)arg;
+
+    pthread_mutex_lock(&pool.mutex);
+    while (1) {
+        job_t *job = pool.head;
+        while (job && worker_id >= job->slot_count) {
+            job = job->link; // limited job, not for us
+        }
+        if (!job) {
+            pthread_cond_wait(&pool.work, &pool.mutex);
+            continue;
+        }
+
+        job->users++;
+        pthread_mutex_unlock(&pool.mutex);
+        run_indices(job, worker_id);
+        pthread_mutex_lock(&pool.mutex);
+
+        // nothing left to hand out: stop offering the job, let the caller go
+        unlink_job(job);
+        job->users--;
+        pthread_cond_broadcast(&pool.finished);
+    }
+    return NULL;
+}
+
+static int default_size(void) {
+    const char *env = getenv("STEG_THREADS");
+    if (env && atoi(env) > 0) {
+        return atoi(env);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+static void pool_start(void) {
+    int size = requested_size > 0 ? requested_size : default_size();
+    if (size > MAX_POOL_THREADS) {
+        size = MAX_POOL_THREADS;
+    }
+
+    // the caller always runs tasks too, so start one thread fewer
+    int started = 1;
+    for (int i = 1; i < size; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, (void *)(intptr_t)i) != 0) {
+            break; // run with what we have
+        }
+        pthread_detach(thread);
+        started++;
+    }
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.size = started;
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+int thread_pool_set_size(int threads) {
+    pthread_mutex_lock(&pool.mutex);
+    int ok = pool.size == 0;
+    if (ok) {
+        requested_size = threads;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return ok;
+}
+
+int thread_pool_size(void) {
+    pthread_once(&pool_once, pool_start);
+    return pool.size;
+}
+
+int thread_pool_worker_id(void) {
+    return worker_id;
+}
+
+void thread_pool_set_limit(int threads) {
+    pthread_once(&pool_once, pool_start);
+    pthread_mutex_lock(&pool.mutex);
+    pool.limit = threads;
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void thread_pool_run(pool_task_fn fn, void *arg, int count) {
+    if (count <= 0) {
+        return;
+    }
+    pthread_once(&pool_once, pool_start);
+
+    int threads = pool.size;
+    if (pool.limit > 0 && pool.limit < threads) {
+        threads = pool.limit;
+    }
+    if (worker_id >= threads) {
+        threads = worker_id + 1; // nested call from a thread above the limit
+    }
+
+    slot_t *slots = NULL;
+    if (count > 1 && threads > 1) {
+        slots = (slot_t *)aligned_alloc(CACHE_LINE, (size_t)threads * sizeof(slot_t));
+    }
+    if (!slots) {
+        for (int i = 0; i < count; i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+
+    // hand every thread an equal contiguous share up front
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&slots[i].lock, NULL);
+        atomic_init(&slots[i].next, (int)((long)count * i / threads));
+        atomic_init(&slots[i].end, (int)((long)count * (i + 1) / threads));
+    }
+
+    job_t job;
+    job.fn = fn;
+    job.arg = arg;
+    job.count = count;
+    job.slots = slots;
+    job.slot_count = threads;
+    atomic_init(&job.done, 0);
+    job.users = 0;
+
+    pthread_mutex_lock(&pool.mutex);
+    job.link = pool.head;
+    pool.head = &job;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mutex);
+
+    run_indices(&job, worker_id);
+
+    // every index is taken; wait for the last ones and for pool threads to
+    // stop touching the job before it goes out of scope
+    pthread_mutex_lock(&pool.mutex);
+    unlink_job(&job);
+    while (atomic_load(&job.done) < job.count || job.users > 0) {
+        pthread_cond_wait(&pool.finished, &pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&slots[i].lock);
+    }
+    free(slots);
+}
+
@@ -0,0 +1,35 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// process-wide worker pool shared by analysis, embedding and encryption.
+// it is created on first use and lives until the process exits
+
+// task callback: index runs from 0 to count - 1
+typedef void (*pool_task_fn)(void *arg, int index);
+
+// request a pool size (threads including the caller, 0 = one per online
+// CPU); the STEG_THREADS environment variable overrides the CPU count too.
+// only effective before the pool is first used, returns 0 afterwards
+int thread_pool_set_size(int threads);
+
+// number of threads that can run tasks at once (pool threads + caller)
+int thread_pool_size(void);
+
+// let at most this many threads (caller included) take part in later runs,
+// 0 = no limit; meant for measuring how the kernels scale
+void thread_pool_set_limit(int threads);
+
+// slot of the calling thread: 1 .. size - 1 for pool threads, 0 for any
+// other thread. tasks use it to index per-thread data sized by
+// thread_pool_size(); within one run no two threads share a slot
+int thread_pool_worker_id(void);
+
+// run fn(arg, i) for every i in [0, count) and wait until all are done.
+// every thread starts on an equal contiguous share of the indices and steals
+// half of the largest remaining share once its own runs out. the calling
+// thread runs tasks too, so a task may itself call thread_pool_run without
+// risk of deadlock
+void thread_pool_run(pool_task_fn fn, void *arg, int count);
+
+#endif
+